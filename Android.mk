@@ -122,9 +122,18 @@ camera_vhal_src := \
 	src/Exif.cpp \
 	src/Thumbnail.cpp \
 	src/CameraSocketServerThread.cpp \
+	src/IngestBufferPool.cpp \
+	src/FrameTripleBuffer.cpp \
+	src/FrameHandle.cpp \
+	src/YuvScaler.cpp \
+	src/CaptureWorkerPool.cpp \
+	src/ScratchBufferPool.cpp \
+	src/FramePacer.cpp \
+	src/SharedFrameRing.cpp \
 	src/CameraSocketCommand.cpp
 ifneq ($(TARGET_BOARD_PLATFORM), celadon)
-camera_vhal_src += src/CGCodec.cpp
+camera_vhal_src += src/CGCodec.cpp \
+	src/DecoderThread.cpp
 endif
 camera_vhal_c_includes := external/libjpeg-turbo \
 	external/libexif \
@@ -177,6 +186,14 @@ else
 camera_vhal_cflags += -DENABLE_FFMPEG
 endif
 
+# io_uring receive path for the client socket. Falls back to recv() at
+# runtime on kernels without multishot receive support.
+ifeq ($(CAMERA_VHAL_USE_IO_URING), true)
+camera_vhal_src += src/IoUringReceiver.cpp
+camera_vhal_cflags += -DENABLE_IO_URING
+camera_vhal_static_libraries += liburing
+endif
+
 LOCAL_MODULE_RELATIVE_PATH	:= ${camera_vhal_module_relative_path}
 LOCAL_CFLAGS				:= ${camera_vhal_cflags}
 LOCAL_CPPFLAGS 				+= -std=c++17
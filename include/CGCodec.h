@@ -17,14 +17,21 @@
 #ifndef CG_CODEC_H
 #define CG_CODEC_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <fstream>
 #include <memory>
+#include <vector>
 #include <stdlib.h>
 #include <stdint.h>
 #include "CameraSocketCommand.h"
 extern "C" {
 #include "libavutil/frame.h"
+#include "libavutil/buffer.h"
+#include "libavutil/hwcontext.h"
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
 #include "libavutil/imgutils.h"
@@ -36,16 +43,31 @@ using namespace std;
 
 enum CGPixelFormat { I420 = 0, NV12 = 1 };
 
+class CGFramePool;
+
 class CGVideoFrame {
 public:
     using Ptr = std::shared_ptr<CGVideoFrame>;
 
     CGVideoFrame() { m_avframe = av_frame_alloc(); }
 
-    virtual ~CGVideoFrame() { av_frame_free(&m_avframe); }
+    // Take over frame of pool, handed back to it on destruction.
+    CGVideoFrame(AVFrame *frame, std::shared_ptr<CGFramePool> pool)
+        : m_avframe(frame), m_pool(std::move(pool)) {}
+
+    virtual ~CGVideoFrame();
 
     int ref_frame(const AVFrame *frame) { return av_frame_ref(m_avframe, frame); }
 
+    // Take over the references of frame, leaving it blank; no allocation.
+    void move_frame(AVFrame *frame) {
+        av_frame_unref(m_avframe);
+        av_frame_move_ref(m_avframe, frame);
+    }
+
+    // Drop the frame data, e.g. to hand pooled buffers back early.
+    void unref() { av_frame_unref(m_avframe); }
+
     uint8_t *data(size_t plane) { return m_avframe->data[plane]; }
 
     int linesize(size_t plane) { return m_avframe->linesize[plane]; }
@@ -60,10 +82,130 @@ public:
 
     int copy_to_buffer(uint8_t *buffer /* out */, int *size /* out */);
 
+    /**
+     * Client sequence number and capture time of the packet the frame was
+     * decoded from, see CGVideoDecoder::decode; 0 if unknown.
+     */
+    uint64_t sequence() { return m_avframe->pkt_pos > 0 ? uint64_t(m_avframe->pkt_pos) : 0; }
+    int64_t capture_time_ns() { return m_avframe->pts != AV_NOPTS_VALUE ? m_avframe->pts : 0; }
+
 private:
     AVFrame *m_avframe;
+    std::shared_ptr<CGFramePool> m_pool;
+};
+
+/*! @class: CGFramePool recycles AVFrame shells and system memory frame buffers */
+
+class CGFramePool {
+public:
+    CGFramePool() { m_free.reserve(kMaxFreeFrames); }
+    ~CGFramePool();
+
+    /**
+     * Get a blank frame; only allocates until the pool is warm
+     * @return the frame, or nullptr if allocation failed
+     */
+    AVFrame *acquire();
+
+    // Unreference frame and keep it for reuse. Thread safe.
+    void release(AVFrame *frame);
+
+    /**
+     * Attach a pooled buffer for a width x height image of format to frame,
+     * with planes and lines aligned to the stride alignment. The buffer pool is
+     * recreated when the frame size changes. Thread safe.
+     * @return 0 on success, a negative AVERROR otherwise
+     */
+    int get_buffer(AVFrame *frame, AVPixelFormat format, int width, int height);
+
+    /**
+     * Line alignment of the pooled buffers, a power of two. Matching the
+     * stride gralloc gives YCbCr buffers lets the sensor copy decoded planes
+     * into them with one memcpy each.
+     */
+    void set_stride_align(int align);
+
+    /**
+     * AVCodecContext::get_buffer2 for software decoding, with the pool as
+     * AVCodecContext::opaque: the codec decodes straight into pooled buffers,
+     * so that decoded frames already have the output stride. Formats the pool
+     * does not handle go to the default allocator.
+     */
+    static int get_video_buffer(AVCodecContext *ctx, AVFrame *frame, int flags);
+
+private:
+    static const size_t kMaxFreeFrames = 16;
+    static const int kDefaultStrideAlign = 64;
+    // Slack after the last plane, as the default allocator leaves: SIMD
+    // motion compensation and deblocking read up to 16 + STRIDE_ALIGN - 1
+    // bytes past the end of a plane, STRIDE_ALIGN being at most 64.
+    static const int kBufferPadding = 16 + 64 - 1;
+
+    // Attach a pooled buffer for an alloc_width x alloc_height image, under m_buffer_lock.
+    int alloc_buffer(AVFrame *frame, AVPixelFormat format, int alloc_width, int alloc_height);
+
+    std::mutex m_lock;  // Guard m_free
+    std::vector<AVFrame *> m_free;
+    std::mutex m_buffer_lock;  // Guard the buffer pool, used by the decoding threads
+    AVBufferPool *m_buffer_pool = nullptr;
+    int m_buffer_size = 0;  // Of the image, without kBufferPadding
+    int m_stride_align = kDefaultStrideAlign;
 };
 
+/*! @class: CGFrameQueue bounded single-producer single-consumer ring of decoded frames */
+
+class CGFrameQueue {
+public:
+    CGFrameQueue() = default;
+    ~CGFrameQueue();
+
+    /**
+     * Producer: queue a decoded frame and wake the consumer.
+     * @return false if the ring is full, the frame is then left to the caller
+     */
+    bool push(AVFrame *frame);
+
+    /**
+     * Consumer: take the newest frame, handing the older ones back to pool
+     * @return the frame, owned by the caller, or nullptr if the ring is empty
+     */
+    AVFrame *pop_latest(CGFramePool &pool);
+
+    /**
+     * Consumer: block until a frame is queued or deadline has passed
+     * @return true if a frame is queued
+     */
+    bool wait(std::chrono::steady_clock::time_point deadline);
+
+    // Consumer: hand all queued frames back to pool.
+    void clear(CGFramePool &pool);
+
+    bool empty() const {
+        return m_head.load(std::memory_order_relaxed) == m_tail.load(std::memory_order_acquire);
+    }
+
+private:
+    static const size_t kCapacity = 8;  // Power of two
+
+    std::array<AVFrame *, kCapacity> m_frames{};
+    std::atomic<size_t> m_head{0};  // Next frame to take, written by the consumer
+    std::atomic<size_t> m_tail{0};  // Next free entry, written by the producer
+
+    // Only used to sleep and wake, never held while accessing the ring.
+    std::mutex m_wait_lock;
+    std::condition_variable m_wait_cond;
+};
+
+/**
+ * Software decoding threading. Chosen with the vendor.camera.decode.sw_threading
+ * property ("auto", "single", "slice" or "frame"); auto picks one from the
+ * resolution and the core budget (vendor.camera.decode.sw_cores, default half
+ * of the online cores).
+ */
+enum class CGDecodeThreading { kAuto, kSingle, kSlice, kFrame };
+
+const char *threading_to_str(CGDecodeThreading threading);
+
 /*! @class: CGVideoDecoder wraps ffmpeg avcodec for video ES decoding */
 
 struct DecodeContext;
@@ -105,7 +247,9 @@ public:
     bool can_decode() const;
 
     /**
-     * Initialize the CGVideoDecoder
+     * Initialize the CGVideoDecoder. A codec context parked by close() or a previous init
+     * for the same codec and resolution is reused, and the hardware device is kept as long
+     * as device_name and extra_hw_frames do not change.
      * @param resolution_type   see @enum camera_video_resolution_t in @file cg_protocol.h
      * @param device_name       the string of hardware acclerator device, such as "vaapi"
      * @param extra_hw_frames   allocate extra frames for hardware acclerator when decoding
@@ -113,22 +257,59 @@ public:
     int init(android::socket::FrameResolution resolution, uint32_t codec_type,
              const char *device_name = nullptr, int extra_hw_frames = 0);
 
+    /**
+     * Switch resolution and codec in place, keeping the device of the last init.
+     * Does nothing if the decoder already runs with that configuration.
+     */
+    int reconfigure(android::socket::FrameResolution resolution, uint32_t codec_type);
+
     /**
      * Send a piece of ES stream data to decoder, the data must have a padding with a lengh
      * of CG_INPUT_BUFFER_PADDING_SIZE
      * @param data      input buffer
      * @param length    buffer size in bytes without the padding. I.e. the full buffer
      *                  size is assumed to be buf_size + CG_INPUT_BUFFER_PADDING_SIZE.
+     * @param sequence  client sequence number, passed on to the decoded frame
+     * @param capture_time_ns   client capture time, passed on to the decoded frame
+     */
+    int decode(const uint8_t *data, int length, uint64_t sequence = 0,
+               int64_t capture_time_ns = 0);
+
+    /**
+     * Send exactly one complete access unit to decoder, bypassing the parser. The data is
+     * not copied: the decoder references it until release(opaque, data) is called, which
+     * happens in all cases, possibly after returning.
+     * @param data      input buffer, with the padding described in decode()
+     * @param length    buffer size in bytes without the padding
      */
-    int decode(const uint8_t *data, int length);
+    int decode_access_unit(const uint8_t *data, int length,
+                           void (*release)(void *opaque, uint8_t *data), void *opaque,
+                           uint64_t sequence = 0, int64_t capture_time_ns = 0);
 
     /**
-     * Get one decoded video frame
+     * Get the latest decoded video frame without waiting; older frames are dropped
      * @param cg_frame  a shared pointer @class CGVideoFrame which wrap ffmpeg av_frame as the
      * output
      */
     int get_decoded_frame(CGVideoFrame::Ptr cg_frame);
 
+    /**
+     * Take the latest decoded video frame, waiting for one until deadline. The frame is
+     * not copied: its buffers go back to the decoder once the last reference is dropped,
+     * so it must not be held longer than needed.
+     * @param deadline  absolute time after which to give up
+     * @return the frame, or nullptr if no frame was decoded in time
+     */
+    CGVideoFrame::Ptr acquire_frame(std::chrono::steady_clock::time_point deadline);
+
+    /**
+     * Wait for a decoded frame to be available to acquire_frame(), without taking it.
+     * @return true if one is available before deadline
+     */
+    bool wait_for_frame(std::chrono::steady_clock::time_point deadline) {
+        return decoded_frames.wait(deadline);
+    }
+
     /**
      * @brief Send flush packet to decoder, indicating end of decoding session.
      *
@@ -137,18 +318,62 @@ public:
     int flush_decoder();
 
     /**
-     * @brief Desotroy cg decoder context and ongoing decode requests.
+     * @brief Stop decoding, e.g. when the camera is closed. The codec context is flushed
+     * and kept warm for a later init with the same configuration.
+     *
+     * @return int
+     */
+    int close();
+
+    /**
+     * @brief Desotroy cg decoder context and ongoing decode requests, warm contexts and
+     * the hardware device included.
      *
      * @return int
      */
     int destroy();
 
+    /**
+     * Error concealment: after a decoding error, a corrupt frame or a call to this function,
+     * decoded frames are dropped, so that consumers keep showing the last good one, until a
+     * keyframe is decoded or vendor.camera.decode.conceal_max_frames frames (default 60, 0
+     * disables concealment) were dropped. Thread safe.
+     */
+    void conceal_until_keyframe();
+    bool awaiting_keyframe() const { return m_awaiting_keyframe; }
+    uint64_t concealed_frames() const { return m_concealed_frames; }
+
+    /**
+     * Threading of the current decoder, see @enum CGDecodeThreading
+     * threads(): number of decoding threads
+     * frame_delay(): frames of output delay added by frame threading
+     */
+    CGDecodeThreading threading() const { return m_threading; }
+    int threads() const { return m_threads; }
+    int frame_delay() const { return m_frame_delay; }
+
 private:
     CGDecContex m_decode_ctx;        ///<! cg decoder internal context
-    CGHWAccelContex m_hw_accel_ctx;  ///<! hw decoding accelerator context
+    std::vector<CGDecContex> m_warm_contexts;  ///<! flushed contexts, least recently used first
+    AVBufferRef *m_hw_dev_ctx = nullptr;       ///<! hw device shared by all contexts
     int decode_one_frame(const AVPacket *pkt);
+    CGDecContex create_context();
+    int reset_context(DecodeContext *ctx);
+    void park_context();
+    int recover();
+    void configure_sw_threading(AVCodecContext *c, int height);
     bool decoder_ready = false;
-    std::recursive_mutex pull_lock;  // Guard m_decode_ctx at get_decoded_frame
+    std::atomic<CGDecodeThreading> m_threading{CGDecodeThreading::kSingle};
+    std::atomic<int> m_threads{1};
+    std::atomic<int> m_frame_delay{0};
+    std::atomic<bool> m_awaiting_keyframe{false};
+    std::atomic<int> m_conceal_max_frames{0};
+    int m_conceal_dropped = 0;  // Frames dropped since the error, under push_lock
+    std::atomic<uint64_t> m_concealed_frames{0};
+    // Shells of decoded_frames and VAAPI download buffers; shared with the frames handed out.
+    std::shared_ptr<CGFramePool> frame_pool = std::make_shared<CGFramePool>();
+    CGFrameQueue decoded_frames;     // Filled by decode, drained by get_decoded_frame
+    std::recursive_mutex pull_lock;  // Guard decoded_frames consumers
     std::recursive_mutex push_lock;  // Guard m_decode_ctx at decode/decode_one_frame
 
     CGVideoDecoder(const CGVideoDecoder &cg_video_decoder);
@@ -156,6 +381,7 @@ private:
     uint32_t codec_type;
     android::socket::FrameResolution resolution;
     const char *device_name;
+    int extra_hw_frames = 0;
 };
 
 #endif  // CG_CODEC_H
@@ -33,7 +33,7 @@ namespace android {
 namespace socket {
 
 enum class VideoCodecType { kH264 = 1, kH265 = 2,kI420 = 4, kMJPEG = 8, kAll = 15 };
-enum class FrameResolution { k480p = 1, k720p = 2, k1080p = 4, kAll = 7 };
+enum class FrameResolution { k480p = 1, k720p = 2, k1080p = 4, k2160p = 8, kAll = 15 };
 
 enum class SensorOrientation {
     ORIENTATION_0 = 0,
@@ -95,9 +95,39 @@ typedef struct _camera_capability {
     uint32_t codec_type;          // All supported codec_type
     uint32_t resolution;          // All supported resolution
     uint32_t maxNumberOfCameras;  // Max will be restricted to 2
-    uint32_t reserved[5];
+    uint32_t reserved[5];         // reserved[0]: camera_transport_t bits offered
+                                  // reserved[1]: highest camera_protocol_version_t
 } camera_capability_t;
 
+/**
+ * Data framing versions. The HAL offers the highest one it supports in
+ * camera_capability_t.reserved[1]; the client selects one by echoing it in
+ * camera_info_t.reserved[1] of camera 0. Any other value selects
+ * CAMERA_PROTOCOL_VERSION_LEGACY.
+ */
+typedef enum _camera_protocol_version {
+    // CAMERA_DATA payloads are the bare frame or packet; TCP/UNIX I420
+    // clients may also send frames without any header.
+    CAMERA_PROTOCOL_VERSION_LEGACY = 0,
+    // Every CAMERA_DATA payload starts with a camera_data_header_t, and the
+    // HAL estimates the client clock offset with CAMERA_CLOCK_SYNC.
+    CAMERA_PROTOCOL_VERSION_3 = 3,
+} camera_protocol_version_t;
+
+/**
+ * Optional frame transports. The HAL offers them in
+ * camera_capability_t.reserved[0]; the client opts in by echoing the bits
+ * it uses in camera_info_t.reserved[0] of camera 0.
+ */
+typedef enum _camera_transport {
+    // Raw I420 frames are exchanged through client shared memory, see
+    // camera_shm_config_t. Offered on UNIX sockets only.
+    CAMERA_TRANSPORT_SHM = 1 << 0,
+    // Every encoded CAMERA_DATA payload holds exactly one complete access
+    // unit, so the HAL decodes it as is without running a bitstream parser.
+    CAMERA_TRANSPORT_AU_ALIGNED = 1 << 1,
+} camera_transport_t;
+
 typedef enum _camera_packet_type {
     REQUEST_CAPABILITY = 0,
     CAPABILITY = 1,
@@ -105,8 +135,80 @@ typedef enum _camera_packet_type {
     CAMERA_DATA = 3,
     ACK = 4,
     CAMERA_INFO = 5,
+    CAMERA_SHM_CONFIG = 6,
+    CAMERA_CLOCK_SYNC = 7,
+    // HAL to client, no payload (CAMERA_PROTOCOL_VERSION_3): the decoder lost
+    // its references, encode the next frame as an IDR. Rate limited by the HAL.
+    CAMERA_REQUEST_KEYFRAME = 8,
 } camera_packet_type_t;
 
+/**
+ * Shared-memory transport (CAMERA_TRANSPORT_SHM).
+ *
+ * After the ACK, the client sends CAMERA_SHM_CONFIG with this payload and a
+ * memfd attached as SCM_RIGHTS ancillary data. The memfd must be sealed
+ * against shrinking (F_SEAL_SHRINK), as the HAL keeps it mapped, and starts with
+ * num_slots uint32_t slot states (camera_shm_slot_state_t), followed at
+ * data_offset by num_slots frames of slot_size bytes each.
+ *
+ * From then on every CAMERA_DATA payload is a camera_shm_frame_t naming the
+ * slot holding the frame. The client only writes slots that are
+ * CAMERA_SHM_SLOT_FREE and marks them CAMERA_SHM_SLOT_READY before sending
+ * CAMERA_DATA; the HAL marks them CAMERA_SHM_SLOT_BUSY while reading and
+ * CAMERA_SHM_SLOT_FREE once the frame is no longer in use. States are accessed
+ * atomically by both sides.
+ */
+typedef enum _camera_shm_slot_state {
+    CAMERA_SHM_SLOT_FREE = 0,
+    CAMERA_SHM_SLOT_READY = 1,
+    CAMERA_SHM_SLOT_BUSY = 2,
+} camera_shm_slot_state_t;
+
+typedef struct _camera_shm_config {
+    uint32_t num_slots;    // Number of frame slots, at most CAMERA_SHM_MAX_SLOTS
+    uint32_t slot_size;    // Bytes per slot, at least one frame at the negotiated resolution
+    uint32_t data_offset;  // Offset of slot 0, page aligned
+    uint32_t codec_type;   // Layout of the frames, only VideoCodecType::kI420
+    uint32_t reserved[4];
+} camera_shm_config_t;
+
+#define CAMERA_SHM_MAX_SLOTS 16
+
+typedef struct _camera_shm_frame {
+    uint32_t slot;          // Slot index holding the frame
+    uint32_t reserved;
+    uint64_t sequence;      // Incremented by one for every frame sent
+    int64_t timestamp_ns;   // Client capture time, CLOCK_MONOTONIC of the client
+} camera_shm_frame_t;
+
+typedef enum _camera_data_flags {
+    CAMERA_DATA_FLAG_KEYFRAME = 1 << 0,       // Encoded packet starts a GOP
+    CAMERA_DATA_FLAG_END_OF_STREAM = 1 << 1,  // Last packet before the stream stops
+} camera_data_flags_t;
+
+/**
+ * Prefix of every CAMERA_DATA payload with CAMERA_PROTOCOL_VERSION_3.
+ * camera_header_t.size includes it.
+ */
+typedef struct _camera_data_header {
+    uint32_t size;          // sizeof(camera_data_header_t), for later extension
+    uint32_t flags;         // camera_data_flags_t
+    uint64_t sequence;      // Starts at 1, incremented by one for every frame sent
+    int64_t timestamp_ns;   // Client capture time, CLOCK_MONOTONIC of the client
+} camera_data_header_t;
+
+/**
+ * Clock offset probe (CAMERA_PROTOCOL_VERSION_3). The HAL sends it with
+ * hal_send_ns set; the client sends it straight back with client_ns set to
+ * its CLOCK_MONOTONIC time. From the round trip the HAL estimates the
+ * client clock as client_ns - (hal_send_ns + hal_receive_ns) / 2.
+ */
+typedef struct _camera_clock_sync {
+    int64_t hal_send_ns;
+    int64_t client_ns;
+    int64_t reserved[2];
+} camera_clock_sync_t;
+
 typedef struct _camera_header {
     camera_packet_type_t type;
     uint32_t size;  // number of cameras * sizeof(camera_info_t)
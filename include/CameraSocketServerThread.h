@@ -19,6 +19,7 @@
 
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <utils/Mutex.h>
 #include <utils/String8.h>
@@ -34,6 +35,10 @@
 #include "CGCodec.h"
 #endif
 #include "CameraSocketCommand.h"
+#include "DecoderThread.h"
+#include "IngestBufferPool.h"
+#include "IoUringReceiver.h"
+#include "SharedFrameRing.h"
 #include <linux/vm_sockets.h>
 
 namespace android {
@@ -61,11 +66,13 @@ public:
     virtual status_t requestExitAndWait();
     int getClientFd();
     void setClientFd(int fd);
-    ssize_t size_update = 0;
     static void* threadFunc(void * arg);
     
     bool configureCapabilities(bool skipCapRead);
 
+    // Writes client protocol statistics for dumpsys.
+    void dump(int fd);
+
 private:
     virtual status_t readyToRun();
     virtual bool threadLoop() override;
@@ -73,23 +80,142 @@ private:
     void setCameraResolution(uint32_t resolution);
     void setCameraMaxSupportedResolution(int32_t width, int32_t height);
 
+    /**
+     * Reactor: a single epoll set multiplexes the listening socket, the
+     * connected client and mControlFd (eventfd used to wake the thread for
+     * shutdown and control requests).
+     */
+    enum ControlEvent : uint32_t {
+        kControlExit = 1 << 0,
+        kControlRequestKeyframe = 1 << 1,  // From the decoder thread.
+    };
+
+    bool setupServerSocket();
+    void serve();
+    void postControlEvent(ControlEvent event);
+    void handleControlEvents();
+    void acceptClients();
+    void handleClientEvents(uint32_t events);
+    bool watchClient();
+    void closeClient();
+    // Blocking mode also bounds each send and receive at kNegotiationTimeoutMs.
+    bool setClientBlocking(bool blocking);
+    static const int kNegotiationTimeoutMs = 2000;
+#ifdef ENABLE_IO_URING
+    void handleUringEvents();
+#endif
+
+    /**
+     * Non-blocking camera_header_t framing. readClient() drains the socket
+     * until EAGAIN, feeding bytes into the window of the current state.
+     * Returns false if the connection must be closed.
+     */
+    bool readClient();
+    ssize_t receive(struct iovec *iov, size_t iovcnt);
+    // Same framing fed with data already received, e.g. by io_uring.
+    bool consumeClientData(const uint8_t *data, size_t size);
+    // Where the next bytes of the current packet go; nullptr to discard them.
+    uint8_t *readerWindow(size_t *len);
+    // Accounts size bytes read into the window and handles completed packets.
+    bool commitRead(size_t size);
+    void startPacket();
+    bool onHeaderReceived();
+    void onDataHeaderReceived();
+    // Continues with a payload of size bytes; keep = false discards it.
+    void startPayload(uint32_t size, bool keep);
+    void onPacketReceived();
+    void onShmConfigReceived();
+    void onShmFrameReceived();
+
+    // Clock offset exchange of protocol v3, see camera_clock_sync_t.
+    void sendClockSync();
+    void onClockSyncReceived();
+    // Client CLOCK_MONOTONIC time in HAL time, or 0 while not synced.
+    int64_t toLocalTime(int64_t clientTimeNs) const;
+
+    // Asks the client for an IDR, at most once per mKeyframeRequestIntervalNs.
+    void sendKeyframeRequest();
+    // A packet of the encoded stream was lost: hold the last good frame and
+    // ask for an IDR.
+    void onStreamDiscontinuity();
+
+    // Bare frames of legacy I420 clients are framed at 640x480, whatever
+    // the negotiated resolution, as they always have been.
+    static const size_t kLegacyRawFrameSize = 640 * 480 * 3 / 2;
+
+    struct PacketReader {
+        enum class State {
+            kHeader,      // Reading camera_header_t.
+            kDataHeader,  // Reading camera_data_header_t (protocol v3 CAMERA_DATA).
+            kPayload,     // Reading the payload.
+            kRawFrame,    // Reading a header-less I420 frame (TCP/UNIX legacy clients).
+        };
+        State state = State::kHeader;
+        socket::camera_header_t header = {};
+        socket::camera_data_header_t dataHeader = {};
+        // Ingest slot receiving the payload; payload points into it, or is
+        // nullptr to discard the payload.
+        IngestBufferRef buffer;
+        uint8_t *payload = nullptr;
+        size_t expected = 0;
+        size_t received = 0;
+    };
+
     Mutex mMutex;
     bool mRunning;  // guarding only when it's important
     int mSocketServerFd = -1;
     std::string mSocketPath;
     int mClientFd = -1;
     int mNumOfCamerasRequested;  // Number of cameras requested to support by client.
+    int mTransMode = VSOCK;
+
+    int mEpollFd = -1;
+    int mControlFd = -1;
+    std::atomic<uint32_t> mPendingControl{0};
+    // Bumped on every accepted client so that events of a closed client
+    // still queued in the same epoll_wait batch are ignored.
+    uint32_t mClientGeneration = 0;
+    PacketReader mReader;
+
+#ifdef ENABLE_IO_URING
+    std::unique_ptr<IoUringReceiver> mUring;  // nullptr if io_uring is unavailable.
+    bool mUringClient = false;                // Client data arrives through mUring.
+#endif
+
+    // Shared-memory transport (CAMERA_TRANSPORT_SHM), negotiated per client.
+    bool mShmTransport = false;
+    int mShmFd = -1;  // memfd received with CAMERA_SHM_CONFIG, until mapped.
+    std::shared_ptr<SharedFrameRing> mShmRing;
+    socket::camera_shm_config_t mShmConfig = {};
+    socket::camera_shm_frame_t mShmFrame = {};
+
+    // Data framing negotiated with the client, see camera_protocol_version_t.
+    uint32_t mProtocolVersion = socket::CAMERA_PROTOCOL_VERSION_LEGACY;
+    uint64_t mLastSequence = 0;  // Of the last accepted frame, 0 at stream start.
+    socket::camera_clock_sync_t mClockSync = {};
+    int mClockSyncSamples = 0;
+    static const int kClockSyncSamples = 8;
+    // Client minus HAL clock, from the probe with the shortest round trip.
+    std::atomic<int64_t> mClockOffsetNs{0};
+    std::atomic<int64_t> mClockRttNs{-1};  // -1 while no probe returned.
+    std::atomic<uint64_t> mFramesLost{0};
+    std::atomic<uint64_t> mFramesStale{0};
+    // Capture to fully received, in HAL time.
+    std::atomic<int64_t> mLastLatencyNs{0};
+    std::atomic<int64_t> mMaxLatencyNs{0};
+
+    // Keyframe requests, see CAMERA_REQUEST_KEYFRAME.
+    int64_t mKeyframeRequestIntervalNs = 0;
+    int64_t mLastKeyframeRequestNs = 0;
+    std::atomic<uint64_t> mKeyframeRequests{0};
+    std::atomic<uint64_t> mKeyframeRequestsLimited{0};
 
 #ifdef ENABLE_FFMPEG
     std::shared_ptr<CGVideoDecoder> mVideoDecoder;
+    std::unique_ptr<DecoderThread> mDecoderThread;
 #endif
     std::atomic<socket::CameraSessionState> &mCameraSessionState;
 
-    // maximum size of a H264 packet in any aggregation packet is 65535 bytes.
-    // Source: https://tools.ietf.org/html/rfc6184#page-13
-    std::array<uint8_t, 200 * 1024> mSocketBuffer = {};
-    size_t mSocketBufferSize = 0;
-
     struct ValidateClientCapability {
         bool validCodecType = false;
         bool validResolution = false;
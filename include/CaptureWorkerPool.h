@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAPTURE_WORKER_POOL_H
+#define CAPTURE_WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace android {
+
+/**
+ * Small pool of threads the sensor spreads capture work over, e.g. the
+ * horizontal bands of a frame conversion.
+ *
+ * Workers are started once. Given a CPU list, they are pinned to its CPUs,
+ * one each, round robin, so that bands keep their caches between frames;
+ * otherwise they are left to the scheduler, as pinning every instance on a
+ * host to the same CPUs would crowd them. The thread calling run() works on
+ * its own tasks too and only waits for the ones already being run by
+ * workers, so run() may be called from inside a task.
+ */
+class CaptureWorkerPool {
+public:
+    explicit CaptureWorkerPool(size_t workers, const std::vector<int> &cpus = {});
+
+    // Parses a CPU list such as "2,3" or "4-7"; empty if invalid.
+    static std::vector<int> parseCpuList(const char *list);
+    ~CaptureWorkerPool();
+
+    size_t workers() const { return mThreads.size(); }
+
+    /**
+     * Calls task(i) for i in [0, count), spread over the calling thread and
+     * the workers, and returns once all calls have returned. Thread safe.
+     */
+    void run(size_t count, const std::function<void(size_t)> &task);
+
+private:
+    struct Batch {
+        const std::function<void(size_t)> *task;
+        size_t count;
+        std::atomic<size_t> next{0};  // Next task index to claim
+        size_t done = 0;              // Under mMutex
+    };
+
+    void threadLoop(int cpu);
+    // Runs claimed task index of batch and accounts for it.
+    void runTask(Batch *batch, size_t index);
+
+    std::mutex mMutex;  // Guards mBatches, Batch::done and mExit.
+    std::condition_variable mWork;
+    std::condition_variable mDone;
+    std::deque<Batch *> mBatches;  // Batches with tasks left to claim
+    bool mExit = false;
+    std::vector<std::thread> mThreads;
+};
+
+}  // namespace android
+
+#endif  // CAPTURE_WORKER_POOL_H
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DECODER_THREAD_H
+#define DECODER_THREAD_H
+
+#ifdef ENABLE_FFMPEG
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "CGCodec.h"
+#include "IngestBufferPool.h"
+
+namespace android {
+
+/**
+ * Decode stage between the socket thread and the sensor.
+ *
+ * Encoded packets are queued by reference to the ingest buffer they were
+ * received in and decoded on a thread of their own, so that parsing,
+ * decoding and the VAAPI surface download never hold up the next receive.
+ * The queue is bounded: when the decoder falls behind, new packets are
+ * dropped instead of backing up the socket.
+ */
+class DecoderThread {
+public:
+    /**
+     * requestKeyframe is called on the decoder thread after every packet
+     * decoded while the decoder conceals errors until the next keyframe.
+     * It must not block.
+     */
+    DecoderThread(std::shared_ptr<CGVideoDecoder> decoder, size_t maxQueuedPackets,
+                  std::function<void()> requestKeyframe);
+    ~DecoderThread();
+
+    /**
+     * Queues packet for decoding without blocking. Returns false, dropping
+     * the packet, if the queue is full.
+     */
+    bool queuePacket(IngestBufferRef packet);
+
+    // Drops the queued packets, e.g. once the camera is closed.
+    void flush();
+
+    /**
+     * Whether every packet is one complete access unit, as negotiated with
+     * CAMERA_TRANSPORT_AU_ALIGNED. Such packets bypass the bitstream parser
+     * and are handed to the decoder without a copy.
+     */
+    void setAccessUnitAligned(bool aligned) { mAccessUnitAligned = aligned; }
+    bool accessUnitAligned() const { return mAccessUnitAligned; }
+
+    size_t queueDepth() const { return mQueueDepth.load(std::memory_order_relaxed); }
+    size_t maxQueueDepth() const { return mMaxQueueDepth.load(std::memory_order_relaxed); }
+    uint64_t decoded() const { return mDecoded.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return mDropped.load(std::memory_order_relaxed); }
+    uint64_t errors() const { return mErrors.load(std::memory_order_relaxed); }
+
+private:
+    void threadLoop();
+
+    std::shared_ptr<CGVideoDecoder> mDecoder;
+    std::function<void()> mRequestKeyframe;
+
+    std::mutex mMutex;  // Guards the queue and mExit.
+    std::condition_variable mCond;
+    // Fixed ring of mQueue.size() packets, allocated once.
+    std::vector<IngestBufferRef> mQueue;
+    size_t mHead = 0;
+    size_t mCount = 0;
+    bool mExit = false;
+    std::atomic<bool> mAccessUnitAligned{false};
+
+    std::atomic<size_t> mQueueDepth{0};
+    std::atomic<size_t> mMaxQueueDepth{0};
+    std::atomic<uint64_t> mDecoded{0};
+    std::atomic<uint64_t> mDropped{0};
+    std::atomic<uint64_t> mErrors{0};
+
+    std::thread mThread;  // Last, so that it starts on a complete object.
+};
+
+}  // namespace android
+
+#endif  // ENABLE_FFMPEG
+
+#endif  // DECODER_THREAD_H
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAME_HANDLE_H
+#define FRAME_HANDLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "IngestBufferPool.h"
+#ifdef ENABLE_FFMPEG
+#include "CGCodec.h"
+#endif
+
+namespace android {
+
+/**
+ * Client frame as read by the sensor: plane pointers and strides, layout,
+ * sequence number and capture time.
+ *
+ * The handle keeps the memory it points to alive by reference, whether it is
+ * an ingest slot (raw and MJPEG input), a client shared-memory slot or a
+ * decoded frame, so frames are read in place instead of being copied into a
+ * buffer of their own first. Copies of a handle share that reference.
+ */
+class FrameHandle {
+public:
+    enum class Layout {
+        kI420,  // Planes Y, U, V.
+        kNV12,  // Planes Y, interleaved UV.
+    };
+
+    FrameHandle() = default;
+
+    /**
+     * Tightly packed width x height frame of layout in buffer. The handle
+     * stays empty if buffer is nullptr or too small for such a frame.
+     */
+    FrameHandle(IngestBufferRef buffer, int width, int height, Layout layout);
+
+#ifdef ENABLE_FFMPEG
+    /**
+     * Decoded frame, with the decoder's strides. The handle stays empty if
+     * frame is nullptr or neither YUV420P nor NV12.
+     */
+    explicit FrameHandle(CGVideoFrame::Ptr frame);
+#endif
+
+    explicit operator bool() const { return mOwner != nullptr; }
+
+    const uint8_t *data(size_t plane) const { return mData[plane]; }
+    int stride(size_t plane) const { return mStride[plane]; }
+    // Row y of plane; chroma rows are half as many as luma rows.
+    const uint8_t *row(size_t plane, int y) const {
+        return mData[plane] + size_t(mStride[plane]) * y;
+    }
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
+    Layout layout() const { return mLayout; }
+
+    /**
+     * Copies an NV12 frame into the NV12 planes of a buffer of the same size,
+     * one memcpy per plane where the strides match, e.g. when decoded into
+     * buffers aligned like the gralloc buffer, and one per line otherwise.
+     * Returns false, copying nothing, if the frame is not NV12.
+     */
+    bool copyToNV12(uint8_t *dstY, int dstStrideY, uint8_t *dstUV, int dstStrideUV) const;
+
+    // Both 0 if unknown, see IngestBuffer::setFrameInfo().
+    uint64_t sequence() const { return mSequence; }
+    int64_t captureTimeNs() const { return mCaptureTimeNs; }
+
+private:
+    static const size_t kMaxPlanes = 3;
+
+    std::shared_ptr<const void> mOwner;
+    const uint8_t *mData[kMaxPlanes] = {};
+    int mStride[kMaxPlanes] = {};
+    int mWidth = 0;
+    int mHeight = 0;
+    Layout mLayout = Layout::kNV12;
+    uint64_t mSequence = 0;
+    int64_t mCaptureTimeNs = 0;
+};
+
+}  // namespace android
+
+#endif  // FRAME_HANDLE_H
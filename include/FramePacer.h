@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include "utils/Timers.h"
+
+namespace android {
+
+/**
+ * Paces the sensor thread against an absolute frame schedule.
+ *
+ * Frame n + 1 is due when frame n ends, frame n's end being its start plus
+ * its duration, rather than a duration after the sensor thread got around
+ * to frame n + 1, so the time spent between frames does not add up. The
+ * thread sleeps with clock_nanosleep(TIMER_ABSTIME) on the clock of
+ * systemTime().
+ *
+ * A frame whose work ends after its deadline is late. With kCatchUp the
+ * schedule is kept, and the following frames start right away until they
+ * are back on it, unless a whole frame or more was lost; then, and always
+ * with kSkip, the missed frame slots are skipped and the thread waits for
+ * the next one, keeping the phase of the schedule.
+ *
+ * In push mode, frames are driven by input instead: a frame ends as soon
+ * as new input is available, a timer only bounding the wait for it, and the
+ * next frame starts from there.
+ *
+ * Work time, wake-up jitter and lateness are kept in histograms for dump().
+ */
+class FramePacer {
+public:
+    enum class LatePolicy { kCatchUp, kSkip };
+
+    explicit FramePacer(LatePolicy policy = LatePolicy::kCatchUp) : mPolicy(policy) {}
+
+    void setLatePolicy(LatePolicy policy) { mPolicy = policy; }
+
+    // Restarts the schedule at the next frame, keeping the statistics.
+    void reset() { mFrameEnd = 0; }
+
+    /**
+     * Starts a frame of frameDuration and returns its scheduled start time,
+     * which is the end of the previous frame. Sensor thread only.
+     */
+    nsecs_t beginFrame(nsecs_t frameDuration);
+
+    // Ends the frame's work and sleeps until it is due to end. Sensor thread only.
+    void endFrame();
+
+    /**
+     * Push mode version of endFrame(): waits with waitForInput(deadline),
+     * which returns whether input is available, for input until
+     * maxFrameDuration after the frame started, but not before
+     * minFrameDuration. The next frame starts once either input is available
+     * or maxFrameDuration has passed.
+     * @return true if ended by input
+     */
+    bool endFrameOnInput(nsecs_t minFrameDuration, nsecs_t maxFrameDuration,
+                         const std::function<bool(nsecs_t deadline)> &waitForInput);
+
+    // Writes the statistics; may be called from any thread.
+    void dump(int fd) const;
+
+private:
+    // Counts of values in [64 us << (i - 1), 64 us << i), the last bucket
+    // taking everything above.
+    class Histogram {
+    public:
+        static const size_t kBuckets = 12;
+        static const nsecs_t kFirstBucket = 64000;
+
+        void add(nsecs_t value);
+        void dump(int fd, const char *name) const;
+
+    private:
+        std::atomic<uint64_t> mCounts[kBuckets] = {};
+        std::atomic<uint64_t> mCount{0};
+        std::atomic<int64_t> mSum{0};
+        std::atomic<int64_t> mMax{0};
+    };
+
+    // Sleeps until deadline, on the clock of systemTime().
+    static bool sleepUntil(nsecs_t deadline);
+
+    // Late by this many frames or more, a catch up is given up.
+    static const int kMaxCatchUpFrames = 1;
+
+    LatePolicy mPolicy;
+    nsecs_t mFrameEnd = 0;  // Of the current frame, 0 before the first
+    nsecs_t mFrameDuration = 0;
+    nsecs_t mWorkStart = 0;
+
+    std::atomic<uint64_t> mFrames{0};
+    std::atomic<uint64_t> mLateFrames{0};
+    std::atomic<uint64_t> mSkippedFrames{0};
+    std::atomic<uint64_t> mInputFrames{0};  // Ended by input, in push mode
+    Histogram mWorkTime;     // From beginFrame() to endFrame()
+    Histogram mWakeUpDelay;  // From a deadline to waking up for it
+    Histogram mLateness;     // Past the deadline, of late frames
+    Histogram mInputWait;    // From the end of work to input, in push mode
+};
+
+}  // namespace android
+
+#endif  // FRAME_PACER_H
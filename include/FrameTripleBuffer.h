@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAME_TRIPLE_BUFFER_H
+#define FRAME_TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include "IngestBufferPool.h"
+
+namespace android {
+
+/**
+ * Latest-frame-wins handoff of client frames to the sensor.
+ *
+ * Three slots rotate between the writer (back), the last published frame
+ * (middle) and the reader (front). Publishing swaps back and middle, reading
+ * swaps middle and front if a newer frame was published, both with a single
+ * atomic exchange, so neither side ever waits for the other. A frame that
+ * was never read is replaced by the next one.
+ *
+ * Every published frame gets a sequence number, starting at 1, from which
+ * the reader counts repeated and skipped frames.
+ */
+class FrameTripleBuffer {
+public:
+    FrameTripleBuffer() = default;
+
+    /**
+     * Makes frame the latest one and returns its sequence number. Writers
+     * are serialized among themselves only: the socket thread is the usual
+     * one, camera open/close publish a black frame.
+     */
+    uint64_t publish(IngestBufferRef frame);
+
+    /**
+     * Returns the newest published frame. Single reader (the sensor thread).
+     * sequence is set to 0 if nothing was published yet.
+     */
+    IngestBufferRef latest(uint64_t *sequence = nullptr);
+
+    // Whether a frame was published since the reader last called latest().
+    bool hasNewFrame() const { return mMiddle.load(std::memory_order_acquire) & kNewFrame; }
+
+    /**
+     * Reader: blocks until hasNewFrame() or deadline has passed.
+     * @return hasNewFrame()
+     */
+    bool waitForNewFrame(std::chrono::steady_clock::time_point deadline);
+
+    uint64_t published() const { return mPublished.load(std::memory_order_relaxed); }
+    // Frames read again because nothing newer was published in between.
+    uint64_t repeated() const { return mRepeated.load(std::memory_order_relaxed); }
+    // Frames replaced by a newer one before they were read.
+    uint64_t dropped() const { return mDropped.load(std::memory_order_relaxed); }
+
+private:
+    static const uint32_t kIndexMask = 0x3;
+    static const uint32_t kNewFrame = 0x4;
+
+    struct Slot {
+        IngestBufferRef frame;
+        uint64_t sequence = 0;
+    };
+
+    Slot mSlots[3];
+    // Index of the middle slot, with kNewFrame set until the reader takes it.
+    std::atomic<uint32_t> mMiddle{1};
+
+    std::mutex mWriterMutex;
+    uint32_t mBack = 0;  // Guarded by mWriterMutex.
+
+    uint32_t mFront = 2;         // Reader only.
+    uint64_t mLastRead = 0;      // Reader only.
+
+    // Only used to sleep and wake the reader, never held while accessing slots.
+    std::mutex mWaitMutex;
+    std::condition_variable mWaitCond;
+
+    std::atomic<uint64_t> mPublished{0};
+    std::atomic<uint64_t> mRepeated{0};
+    std::atomic<uint64_t> mDropped{0};
+};
+
+}  // namespace android
+
+#endif  // FRAME_TRIPLE_BUFFER_H
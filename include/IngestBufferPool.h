@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INGEST_BUFFER_POOL_H
+#define INGEST_BUFFER_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace android {
+
+/**
+ * Bytes kept zeroed after the valid data of every ingest buffer, so that
+ * encoded packets can be handed to the decoder without a copy. Must match
+ * CG_INPUT_BUFFER_PADDING_SIZE.
+ */
+#define INGEST_BUFFER_PADDING_SIZE 64
+
+/**
+ * One slot of the ingest ring. Storage grows on demand and is never
+ * cleared; only the padding after the valid data is zeroed.
+ */
+class IngestBuffer {
+public:
+    uint8_t *data() { return mData; }
+    const uint8_t *data() const { return mData; }
+
+    // Number of valid bytes, as set by setSize().
+    size_t size() const { return mSize; }
+    size_t capacity() const { return mCapacity; }
+
+    // Marks size bytes as valid and zeroes the padding after them.
+    // Not available for wrapped buffers, which have no padding.
+    void setSize(size_t size);
+
+    /**
+     * Client sequence number and capture time, converted to the HAL's
+     * CLOCK_MONOTONIC, of the frame. Both are 0 if the client does not send
+     * them (protocol v3) or, for the capture time, its clock is not synced.
+     */
+    uint64_t sequence() const { return mSequence; }
+    int64_t captureTimeNs() const { return mCaptureTimeNs; }
+    void setFrameInfo(uint64_t sequence, int64_t captureTimeNs) {
+        mSequence = sequence;
+        mCaptureTimeNs = captureTimeNs;
+    }
+
+    /**
+     * Wraps a frame in memory owned elsewhere, such as a client shared-memory
+     * slot, so that it can be passed on like a pooled buffer. release is
+     * called once the last reference is dropped.
+     */
+    static std::shared_ptr<IngestBuffer> wrap(uint8_t *data, size_t size,
+                                              std::function<void()> release);
+
+private:
+    friend class IngestBufferPool;
+
+    bool reserve(size_t size);
+
+    uint8_t *mData = nullptr;
+    std::unique_ptr<uint8_t[]> mStorage;
+    size_t mCapacity = 0;
+    size_t mSize = 0;
+    uint64_t mSequence = 0;
+    int64_t mCaptureTimeNs = 0;
+    std::atomic<bool> mInUse{false};
+};
+
+/**
+ * Reference to an acquired slot. The slot returns to the ring once the
+ * last reference is dropped.
+ */
+using IngestBufferRef = std::shared_ptr<IngestBuffer>;
+
+/**
+ * Fixed ring of refcounted ingest slots shared by the socket server (producer)
+ * and the decoder/sensor (consumers). recv() writes straight into a slot which
+ * is then passed along by reference, without clearing or copying it.
+ */
+class IngestBufferPool {
+public:
+    explicit IngestBufferPool(size_t numSlots);
+
+    /**
+     * Returns a free slot able to hold size bytes plus padding, preferring
+     * one that already can over growing one, or nullptr if every slot is
+     * still referenced or allocation failed.
+     */
+    IngestBufferRef acquire(size_t size);
+
+    // Frees the storage of every slot not referenced, e.g. after a client
+    // left, whose frames may have been larger than the next one's.
+    void trim();
+
+    size_t numSlots() const { return mSlots.size(); }
+
+private:
+    std::mutex mMutex;  // Guards mNext, taking slots and their storage.
+    size_t mNext = 0;
+    std::vector<std::shared_ptr<IngestBuffer>> mSlots;
+};
+
+}  // namespace android
+
+#endif  // INGEST_BUFFER_POOL_H
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IO_URING_RECEIVER_H
+#define IO_URING_RECEIVER_H
+
+#ifdef ENABLE_IO_URING
+
+#include <liburing.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace android {
+
+/**
+ * io_uring receive backend for the camera client socket.
+ *
+ * One multishot recv stays armed per connection and fills buffers from a
+ * provided buffer ring, so a burst of small encoded packets is received
+ * without a syscall per packet. Completions are signalled on eventFd(),
+ * which the socket server watches in its epoll set.
+ */
+class IoUringReceiver {
+public:
+    IoUringReceiver() = default;
+    ~IoUringReceiver();
+
+    /**
+     * Creates the ring and registers its receive buffers. Returns false if
+     * io_uring or multishot receive is not available on this kernel, in which
+     * case the caller keeps using recv().
+     */
+    bool init();
+
+    // Signalled whenever completions are pending.
+    int eventFd() const { return mEventFd; }
+
+    // False once the kernel turned out not to support multishot receive.
+    bool usable() const { return mUsable; }
+
+    // Arms a multishot receive on fd.
+    bool start(int fd);
+
+    // Cancels the receive on the current fd; must be called before closing it.
+    void stop();
+
+    /**
+     * Passes every received chunk to onData, in order, until no completion
+     * is left. Returns false once the peer closed the connection, the
+     * receive failed, or onData returned false.
+     */
+    bool processCompletions(const std::function<bool(const uint8_t *, size_t)> &onData);
+
+private:
+    bool armReceive();
+    void recycleBuffer(uint16_t bid);
+
+    static const unsigned kQueueDepth = 16;
+    static const unsigned kNumBuffers = 32;  // Must be a power of two.
+    static const size_t kBufferSize = 64 * 1024;
+    static const int kBufferGroup = 0;
+
+    struct io_uring mRing = {};
+    bool mRingReady = false;
+    struct io_uring_buf_ring *mBufRing = nullptr;
+    uint8_t *mBuffers = nullptr;
+    int mEventFd = -1;
+    bool mUsable = false;
+    int mFd = -1;
+    bool mArmed = false;
+    // Tags the receive of each connection so completions of a cancelled
+    // receive are not taken for data of the next one.
+    uint64_t mGeneration = 0;
+};
+
+}  // namespace android
+
+#endif  // ENABLE_IO_URING
+
+#endif  // IO_URING_RECEIVER_H
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SCRATCH_BUFFER_POOL_H
+#define SCRATCH_BUFFER_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace android {
+
+/**
+ * Process wide pool of intermediate frame buffers, such as scaled frames
+ * and the NV21 source of JPEG captures.
+ *
+ * Buffers are allocated on first use, sized for the frame at hand, and kept
+ * for reuse once released, across sensor sessions, so that opening a camera
+ * neither allocates nor clears any frame memory. Contents are undefined.
+ */
+class ScratchBufferPool {
+public:
+    // Alignment of every buffer, a cache line and the widest SIMD access.
+    static const size_t kAlignment = 64;
+
+    static ScratchBufferPool &getInstance();
+
+    /**
+     * Returns a buffer of at least size bytes, to be given back with
+     * release(), or nullptr if allocation failed. Thread safe.
+     */
+    uint8_t *acquire(size_t size);
+    void release(uint8_t *buffer);
+
+private:
+    // Free buffers beyond this many are freed, smallest first.
+    static const size_t kMaxFreeBuffers = 4;
+
+    struct Buffer {
+        uint8_t *data;
+        size_t capacity;
+        bool inUse;
+    };
+
+    // Never destroyed, as buffers may be released during exit.
+    ScratchBufferPool() = default;
+
+    std::mutex mMutex;  // Guards mBuffers.
+    std::vector<Buffer> mBuffers;
+};
+
+struct ScratchBufferRelease {
+    void operator()(uint8_t *buffer) const { ScratchBufferPool::getInstance().release(buffer); }
+};
+
+// Scope owner of an acquired buffer.
+using ScratchBuffer = std::unique_ptr<uint8_t, ScratchBufferRelease>;
+
+}  // namespace android
+
+#endif  // SCRATCH_BUFFER_POOL_H
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHARED_FRAME_RING_H
+#define SHARED_FRAME_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "CameraSocketCommand.h"
+#include "IngestBufferPool.h"
+
+namespace android {
+
+/**
+ * Client memfd ring of raw frames for the CAMERA_TRANSPORT_SHM transport,
+ * see camera_shm_config_t for the layout and slot handshake.
+ */
+class SharedFrameRing : public std::enable_shared_from_this<SharedFrameRing> {
+public:
+    /**
+     * Maps the ring described by config, with slots of at least frameSize
+     * bytes. Takes ownership of fd, which is closed once mapped. Returns
+     * nullptr if the config does not match the memfd, or the memfd is not
+     * sealed against shrinking.
+     */
+    static std::shared_ptr<SharedFrameRing> map(int fd, const socket::camera_shm_config_t &config,
+                                                size_t frameSize);
+
+    ~SharedFrameRing();
+
+    /**
+     * Returns the READY frame in slot as an ingest buffer. The slot is handed
+     * back to the client when the last reference is dropped; the mapping
+     * stays valid until then even if the client disconnects.
+     */
+    IngestBufferRef acquireSlot(uint32_t slot);
+
+private:
+    SharedFrameRing() = default;
+
+    std::atomic<uint32_t> *slotState(uint32_t slot);
+
+    uint8_t *mBase = nullptr;
+    size_t mMapSize = 0;
+    socket::camera_shm_config_t mConfig = {};
+};
+
+}  // namespace android
+
+#endif  // SHARED_FRAME_RING_H
@@ -1,7 +1,10 @@
 #ifndef HW_EMULATOR_CAMERA_VIRTUALD_CAMERA_FACTORY_H_K
 #define HW_EMULATOR_CAMERA_VIRTUALD_CAMERA_FACTORY_H_K
 
+#include <algorithm>
 #include <mutex>
+#include "FrameTripleBuffer.h"
+#include "IngestBufferPool.h"
 
 #define BPP_NV12 1.5  // 12 bpp
 
@@ -9,9 +12,13 @@ namespace android {
 
 extern bool gIsInFrameI420;
 extern bool gIsInFrameH264;
+extern bool gIsInFrameH265;
 extern bool gIsInFrameMJPG;
 extern bool gUseVaapi;
 
+// Client sends an encoded (H264 or H265) stream that is decoded in the HAL.
+inline bool isInFrameEncoded() { return gIsInFrameH264 || gIsInFrameH265; }
+
 // Max no of cameras supported based on client device request.
 extern uint32_t gMaxNumOfCamerasSupported;
 
@@ -50,49 +57,12 @@ extern bool gCapabilityInfoReceived;
 extern bool gStartMetadataUpdate;
 extern bool gDoneMetadataUpdate;
 
-enum class VideoBufferType {
-    kI420,
-    kARGB,
-};
-
-struct Resolution {
-    int width = gMaxSupportedWidth;
-    int height = gMaxSupportedHeight;
-};
-/// Video buffer and its information
-struct VideoBuffer {
-    /// Video buffer
-    uint8_t* buffer;
-    /// Resolution for the Video buffer
-    Resolution resolution;
-    // Buffer type
-    VideoBufferType type;
-    ~VideoBuffer() {}
-
-    // To reset allocated buffer.
-    void reset() {
-        std::fill(buffer, buffer + resolution.width * resolution.height, 0x10);
-        uint8_t* uv_offset = buffer + resolution.width * resolution.height;
-        std::fill(uv_offset, uv_offset + (resolution.width * resolution.height) / 2, 0x80);
-        decoded = false;
-    }
-
-    // To clear used buffer based on current resolution.
-    void clearBuffer() {
-        std::fill(buffer, buffer + gSrcWidth * gSrcHeight, 0x10);
-        uint8_t* uv_offset = buffer + gSrcWidth * gSrcHeight;
-        std::fill(uv_offset, uv_offset + (gSrcWidth * gSrcHeight) / 2, 0x80);
-        decoded = false;
-    }
-
-    bool decoded = false;
-};
+extern std::mutex client_buf_mutex;
 
 class ClientVideoBuffer {
 public:
     static ClientVideoBuffer* ic_instance;
 
-    struct VideoBuffer clientBuf[1];
     unsigned int clientRevCount = 0;
     unsigned int clientUsedCount = 0;
 
@@ -106,38 +76,75 @@ public:
         return ic_instance;
     }
 
-    ClientVideoBuffer() {
-        for (int i = 0; i < 1; i++) {
-            clientBuf[i].buffer = new uint8_t[clientBuf[i].resolution.width *
-                                              clientBuf[i].resolution.height * BPP_NV12];
-        }
-        clientRevCount = 0;
-        clientUsedCount = 0;
+    // Encoded packets that may wait for the decoder thread.
+    static const size_t kDecodeQueueDepth = 4;
+
+    ClientVideoBuffer() : mPool(kNumIngestBuffers) {}
+
+    // Slot of the ingest ring for a packet or frame of size bytes.
+    IngestBufferRef acquireBuffer(size_t size) { return mPool.acquire(size); }
+
+    // Size of an NV12/I420 frame at the max supported resolution.
+    static size_t maxFrameSize() {
+        return gMaxSupportedWidth * gMaxSupportedHeight * BPP_NV12;
     }
 
-    ~ClientVideoBuffer() {
-        for (int i = 0; i < 1; i++) {
-            delete[] clientBuf[i].buffer;
-        }
+    // Makes frame the latest raw client frame handed to the sensor and
+    // returns its sequence number.
+    uint64_t publishFrame(IngestBufferRef frame) { return mFrames.publish(std::move(frame)); }
+
+    // Newest published frame; only to be called from the sensor thread.
+    IngestBufferRef latestFrame(uint64_t *sequence = nullptr) { return mFrames.latest(sequence); }
+
+    // Waits for a frame newer than the last latestFrame(); sensor thread only.
+    bool waitForFrame(std::chrono::steady_clock::time_point deadline) {
+        return mFrames.waitForNewFrame(deadline);
     }
 
+    // Handoff statistics since boot, see FrameTripleBuffer.
+    const FrameTripleBuffer &frameStats() const { return mFrames; }
+
     void reset() {
-        for (int i = 0; i < 1; i++) {
-            clientBuf[i].reset();
-        }
+        publishBlackFrame(gMaxSupportedWidth, gMaxSupportedHeight);
+        // The next client may send smaller frames, or encoded ones.
+        mPool.trim();
         clientRevCount = clientUsedCount = 0;
         receivedFrameNo = decodedFrameNo = 0;
     }
 
+    // To clear used buffer based on current resolution.
     void clearBuffer() {
-        for (int i = 0; i < 1; i++) {
-            clientBuf[i].clearBuffer();
-        }
+        publishBlackFrame(gSrcWidth, gSrcHeight);
         clientRevCount = clientUsedCount = 0;
         receivedFrameNo = decodedFrameNo = 0;
     }
+
+private:
+    // Access units a frame threaded decoder may still reference after they
+    // were sent, one per decoding thread, when they bypass the parser.
+    static const size_t kDecoderPacketRefs = 8;
+
+    // Writer, published and read handoff frames and the sensor frame, plus a
+    // spare, and the packets queued for, being and still referenced by the
+    // decoder. Decoded frames live in the decoder's own pool.
+    static const size_t kNumIngestBuffers = 5 + kDecodeQueueDepth + 1 + kDecoderPacketRefs;
+
+    void publishBlackFrame(int width, int height) {
+        IngestBufferRef frame = acquireBuffer(maxFrameSize());
+        if (frame == nullptr) {
+            publishFrame(nullptr);
+            return;
+        }
+        std::fill(frame->data(), frame->data() + width * height, 0x10);
+        uint8_t* uv_offset = frame->data() + width * height;
+        std::fill(uv_offset, uv_offset + (width * height) / 2, 0x80);
+        frame->setSize(maxFrameSize());
+        publishFrame(frame);
+    }
+
+    IngestBufferPool mPool;
+    FrameTripleBuffer mFrames;
 };
-extern std::mutex client_buf_mutex;
 };  // namespace android
 
 #endif  // HW_EMULATOR_CAMERA_VIRTUALD_CAMERA_FACTORY_H_K
@@ -232,6 +232,11 @@ public:
 
     std::shared_ptr<CameraSocketServerThread> mSocketServer;
 private:
+#ifdef ENABLE_FFMPEG
+    // Shared by the socket server, which feeds it, and the cameras, which
+    // initialize it and read the decoded frames.
+    std::shared_ptr<CGVideoDecoder> mDecoder;
+#endif
     bool createSocketServer();
 };
 
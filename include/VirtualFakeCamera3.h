@@ -237,6 +237,7 @@ private:
         DECODER_SUPPORTED_RESOLUTION_480P = 480,
         DECODER_SUPPORTED_RESOLUTION_720P = 720,
         DECODER_SUPPORTED_RESOLUTION_1080P = 1080,
+        DECODER_SUPPORTED_RESOLUTION_2160P = 2160,
     };
 
     /** Processing thread for sending out results */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef YUV_SCALER_H
+#define YUV_SCALER_H
+
+#include <cstdint>
+#include <vector>
+#include "FrameHandle.h"
+
+namespace android {
+
+/**
+ * Single pass scaling and conversion of client frames into sensor outputs.
+ *
+ * Scaling is nearest-neighbour, like the libyuv kFilterNone scaling it
+ * replaces, but source rows are sampled straight into the output instead of
+ * going through a converted copy and a scaled copy of the whole frame. RGBA
+ * outputs are converted from a window of a few scaled rows that stays in
+ * cache. Rows are resampled with SSE4.1 or AVX2 when the CPU has them and the
+ * ratio is 1:1 or 2:1, the common preview and thumbnail sizes; other ratios
+ * use a precomputed column map.
+ *
+ * Output rows only depend on the source rows they sample, so an output can
+ * be made in horizontal bands, concurrently: prepare() for the frame size
+ * once, then make each band with the const functions, which are thread safe.
+ */
+class YuvScaler {
+public:
+    YuvScaler() = default;
+
+    // Sets up scaling of frames the size of in to width x height.
+    void prepare(const FrameHandle &in, int width, int height);
+
+    /**
+     * Scales rows [firstRow, firstRow + rows) of in into the prepared size,
+     * as semi-planar YUV 4:2:0 with interleaved chroma in V, U order (NV21) if
+     * vuOrder, U, V order (NV12) otherwise. dstY and dstUV are the first rows
+     * of the whole output; firstRow is even.
+     */
+    void toSemiPlanarRows(const FrameHandle &in, uint8_t *dstY, int dstStrideY, uint8_t *dstUV,
+                          int dstStrideUV, int firstRow, int rows, bool vuOrder) const;
+
+    // Same as above, into RGBA of byte order R, G, B, A (libyuv ABGR).
+    void toABGRRows(const FrameHandle &in, uint8_t *dst, int dstStride, int firstRow,
+                    int rows) const;
+
+private:
+    // Rows of the cached window RGBA outputs are converted from, even.
+    static const int kWindowRows = 16;
+
+    // dstY and dstUV point to rows firstRow and firstRow / 2.
+    void scaleRows(const FrameHandle &in, uint8_t *dstY, int dstStrideY, uint8_t *dstUV,
+                   int dstStrideUV, int firstRow, int rows, bool vuOrder) const;
+
+    int mSrcWidth = 0, mSrcHeight = 0;
+    int mDstWidth = 0, mDstHeight = 0;
+    // Source column of each output luma column and chroma pair.
+    std::vector<int> mLumaColumns;
+    std::vector<int> mChromaColumns;
+};
+
+}  // namespace android
+
+#endif  // YUV_SCALER_H
@@ -39,6 +39,8 @@ struct StreamBuffer {
     uint32_t stride;
     buffer_handle_t *buffer;
     uint8_t *img;
+    // Plane layout of flexible YUV buffers as locked; y is nullptr otherwise.
+    android_ycbcr ycbcr;
 };
 typedef Vector<StreamBuffer> Buffers;
 
@@ -32,6 +32,7 @@
 #include <CameraMetadata.h>
 
 #include <stdio.h>
+#include <algorithm>
 
 extern "C" {
 #include <jpeglib.h>
@@ -76,6 +77,12 @@ public:
     // TODO: Measure this
     static const size_t kMaxJpegSize = 600000;
 
+    // Size of the BLOB buffers for captures of width x height: 8 bits a
+    // pixel, well above what quality 90 compresses camera frames to.
+    static size_t maxJpegSize(int32_t width, int32_t height) {
+        return std::max(kMaxJpegSize, size_t(width) * height);
+    }
+
 private:
     Mutex mBusyMutex;
     bool mIsBusy = false;
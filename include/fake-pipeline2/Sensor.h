@@ -82,12 +82,20 @@
 #include "CGCodec.h"
 #include "CGLog.h"
 #endif
+#include <atomic>
+#include <memory>
 #include <mutex>
-#include <future>
+#include <vector>
 #include <array>
 
 #include "Scene.h"
 #include "Base.h"
+#include "FrameHandle.h"
+#include "YuvScaler.h"
+#include "CaptureWorkerPool.h"
+#include "FramePacer.h"
+#include "IngestBufferPool.h"
+#include "ScratchBufferPool.h"
 
 using namespace std::chrono_literals;
 
@@ -116,6 +124,13 @@ public:
      */
     Scene &getScene();
 
+    // Writes frame pacing statistics for dumpsys.
+    void dump(int fd);
+
+    // Forgets which gralloc buffers hold which output, as the buffers of
+    // the old streams may be freed and their handles reused.
+    void onStreamsConfigured();
+
     /*
      * Controls that can be updated every frame
      */
@@ -236,10 +251,121 @@ private:
     Scene mScene;
 
     void captureRaw(uint8_t *img, uint32_t gain, uint32_t stride);
-    void captureRGBA(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height);
     void captureRGB(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height);
-    void captureNV12(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height);
-    void captureNV21(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height);
+
+    /**
+     * Client frame outputs, made from in with scaler.
+     * ycbcr, if not nullptr, is the plane layout the buffer was locked with.
+     */
+    void captureRGBA(const FrameHandle &in, YuvScaler &scaler, uint8_t *img, uint32_t width,
+                     uint32_t height);
+    void captureNV12(const FrameHandle &in, YuvScaler &scaler, uint8_t *img, uint32_t width,
+                     uint32_t height, const android_ycbcr *ycbcr = nullptr);
+    void captureNV21(const FrameHandle &in, YuvScaler &scaler, uint8_t *img, uint32_t width,
+                     uint32_t height);
+
+    /**
+     * Capture planning: the client frame outputs of a request (RGBA and YUV
+     * buffers) are grouped by size, as there is no per-stream crop, the whole
+     * client frame always being used. Outputs of a group sharing a scaled size
+     * are made from a single scaled frame, and groups run concurrently.
+     *
+     * Each conversion is also split into horizontal bands run on
+     * mCapturePool. Bands are added while captures miss 3/4 of the frame
+     * duration and dropped while the fewer bands would still make half of it.
+     */
+    struct CaptureGroup {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::vector<size_t> buffers;  // Indices into mNextCapturedBuffers
+    };
+
+    // Memory written to an output: size bytes from base, with the plane
+    // offsets and strides of flexible YUV buffers in layout.
+    struct OutputRegion {
+        uint8_t *base = nullptr;
+        size_t size = 0;
+        std::array<size_t, 5> layout = {};
+    };
+    struct CachedOutput {
+        uint64_t generation = 0;
+        uint32_t format = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        OutputRegion region;  // base unused
+        size_t capacity = 0;
+        ScratchBuffer data;
+    };
+    // Gralloc buffer and the output it was last written with. Handles are
+    // only unique within a stream configuration.
+    struct HeldOutput {
+        buffer_handle_t handle;
+        uint64_t configuration;
+        uint64_t generation;
+        uint32_t format;
+        uint32_t width;
+        uint32_t height;
+    };
+    // Per group state, so that groups can run in parallel.
+    struct CaptureWorker {
+        YuvScaler scaler;
+        std::vector<CachedOutput> outputs;  // Kept while client frames repeat
+        std::vector<size_t> pending;        // Of group.buffers, to be converted
+    };
+    std::vector<CaptureGroup> mCaptureGroups;  // Reused, mNumCaptureGroups in use
+    size_t mNumCaptureGroups = 0;
+    std::vector<CaptureWorker> mCaptureWorkers;
+    FramePacer mPacer;
+
+    /**
+     * Output cache: a client frame captured again, as when the client sends
+     * fewer frames than requested, is converted once per output format and
+     * size, the crop always being the whole frame. An output already holding
+     * it is left as is, and while client frames repeat, each conversion is
+     * kept and copied to the outputs that do not. Client frames are told
+     * apart by mInputGeneration, which changes with mInputFrame's contents.
+     * Conversions are kept for kCacheRepeatFrames frames after a repeat.
+     */
+    static const int kCacheRepeatFrames = 8;
+    uint64_t mInputGeneration = 0;
+    uint64_t mInputSequence = 0;       // Of the last raw client frame
+    uint64_t mCapturedGeneration = 0;  // Of the last captureClientFrame()
+    int mCacheFrames = 0;              // Left to keep conversions for
+    std::mutex mHeldOutputsMutex;  // Guards mHeldOutputs and mConfiguration
+    std::vector<HeldOutput> mHeldOutputs;
+    uint64_t mConfiguration = 0;  // Of the output streams, see onStreamsConfigured()
+    std::atomic<uint64_t> mOutputsConverted{0};
+    std::atomic<uint64_t> mOutputsCopied{0};
+    std::atomic<uint64_t> mOutputsHeld{0};
+    static bool outputRegion(const StreamBuffer &b, OutputRegion *region);
+    void setHeldOutput(const StreamBuffer &b);
+    // Reuses an earlier conversion of the input for b; false if there is none.
+    bool reuseOutput(CaptureWorker &worker, const StreamBuffer &b);
+    void cacheOutput(CaptureWorker &worker, const StreamBuffer &b);
+
+    /**
+     * Push mode: instead of on the frame duration timer, frames are captured
+     * as soon as a new client frame is available, not faster than the
+     * minimum frame duration, and timestamped with its capture time, or
+     * arrival time if unknown. The timer only bounds the wait, at
+     * kPushTimeoutFrames frame durations, so that a slow client does not get
+     * frames repeated.
+     */
+    static const int kPushTimeoutFrames = 2;
+    bool mPushMode = false;
+    nsecs_t mLastCaptureTime = 0;  // Of the last push mode frame
+    // Waits for a client frame newer than mInputFrame until deadline.
+    bool waitForInput(nsecs_t deadline);
+    nsecs_t inputCaptureTime(nsecs_t fallback);
+    std::unique_ptr<CaptureWorkerPool> mCapturePool;
+    size_t mCaptureBands = 1;
+    nsecs_t mCaptureDuration = 0;  // Of the last captureClientFrame()
+    void planCapture(size_t index);
+    void captureClientFrame();
+    void updateCaptureBands(nsecs_t frameDuration);
+    // Calls band(firstRow, rows) over [0, height) in even bands, concurrently.
+    void forEachBand(uint32_t height, const std::function<void(int, int)> &band);
+    void captureGroup(const FrameHandle &in, size_t group);
     void captureDepth(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height);
     void captureDepthCloud(uint8_t *img);
     void saveNV21(uint8_t *img, uint32_t size);
@@ -249,38 +375,21 @@ private:
     // m_major_version 0: CPU 1: SG1
     uint8_t m_major_version = 1;
 
-    // Max supported resolution and size of client/source camera HW.
-    // HAL supports max 1080p resolution.
+    // Max supported resolution and size of client/source camera HW,
+    // as negotiated with the client, up to 2160p.
     int mSrcWidth = 0;
     int mSrcHeight = 0;
-    uint32_t mSrcFrameSize = 0;
-
-    /**
-     * Allocate static memories to avoid continuous allocation on every open camera.
-     * Hence allocating buffers for max supported resolution, that is 1080p.
-     */
-
-    static const size_t maxSupportedResWidth = 1920;
-    static const size_t maxSupportedResHeight = 1080;
-    static const size_t bpp = 2;  // 12 bpp for NV12/NV21 and 4 bits extra for FHD operations.
-    static const size_t buffSize = maxSupportedResWidth * maxSupportedResHeight * bpp;
-
-    // Allocate memories for resolution scaling operation in preview.
-    std::array<uint8_t, buffSize> mDstTempPrevBuf = {};
-    std::array<uint8_t, buffSize> mDstPrevBuf = {};
-
-    // Allocate memories for resolution scaling operation in capture/record.
-    std::array<uint8_t, buffSize> mDstTempBuf = {};
-    std::array<uint8_t, buffSize> mDstBuf = {};
-
-    // Allocate memories for resolution scaling operation in JPEG capture.
-    std::array<uint8_t, buffSize> mDstJpegTempBuf = {};
-    std::array<uint8_t, buffSize> mDstJpegBuf = {};
 
 #ifdef ENABLE_FFMPEG
     std::shared_ptr<CGVideoDecoder> mDecoder = {};
+    FrameHandle getDecodedFrame(std::chrono::milliseconds timeout_ms = 30ms);
 #endif
-    bool getNV12Frames(uint8_t *out_buf, int *out_size, std::chrono::milliseconds timeout_ms = 5ms);
+    // Client frame all captures of the current cycle are read from, in place.
+    // Held by reference, so the socket server and the decoder keep filling
+    // other buffers.
+    FrameHandle mInputFrame;
+    bool mInputFrameDecoded = false;
+    const FrameHandle *getInputFrame();
     void dump_yuv(uint8_t *img1, size_t img1_size, uint8_t *img2, size_t img2_size,
                   const std::string &filename);
 };
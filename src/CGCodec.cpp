@@ -25,9 +25,13 @@
 #endif
 
 #define MAX_DEVICE_NAME_SIZE 21
-#define MAX_ALLOWED_PENDING_FRAMES 2
+#define MAX_SW_DECODE_THREADS 8
+#define MAX_WARM_DECODE_CONTEXTS 2
 
 #include <cutils/properties.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include <vector>
 #include <mutex>
 #include "CGCodec.h"
@@ -38,6 +42,14 @@ using namespace std;
 
 //////// @class CGVideoFrame ////////
 
+CGVideoFrame::~CGVideoFrame() {
+    if (m_pool) {
+        m_pool->release(m_avframe);
+    } else {
+        av_frame_free(&m_avframe);
+    }
+}
+
 CGPixelFormat CGVideoFrame::format() {
     switch (m_avframe->format) {
         case AV_PIX_FMT_NV12:
@@ -72,25 +84,181 @@ int CGVideoFrame::copy_to_buffer(uint8_t *out_buffer, int *size) {
     ALOGVV("%s: X", __func__);
     return 0;
 }
+
+//////// @class CGFramePool ////////
+
+CGFramePool::~CGFramePool() {
+    for (AVFrame *frame : m_free) {
+        av_frame_free(&frame);
+    }
+    // Buffers still referenced keep the pool alive until they are returned.
+    av_buffer_pool_uninit(&m_buffer_pool);
+}
+
+AVFrame *CGFramePool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (!m_free.empty()) {
+            AVFrame *frame = m_free.back();
+            m_free.pop_back();
+            return frame;
+        }
+    }
+    return av_frame_alloc();
+}
+
+void CGFramePool::release(AVFrame *frame) {
+    if (frame == nullptr) return;
+    av_frame_unref(frame);
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_free.size() < kMaxFreeFrames) {
+        m_free.push_back(frame);
+    } else {
+        av_frame_free(&frame);
+    }
+}
+
+int CGFramePool::alloc_buffer(AVFrame *frame, AVPixelFormat format, int alloc_width,
+                              int alloc_height) {
+    int size = av_image_get_buffer_size(format, alloc_width, alloc_height, m_stride_align);
+    if (size < 0) return size;
+
+    if (size != m_buffer_size) {
+        // Buffers still referenced keep the old pool alive until they are returned.
+        av_buffer_pool_uninit(&m_buffer_pool);
+        m_buffer_pool = av_buffer_pool_init(size + kBufferPadding, nullptr);
+        m_buffer_size = m_buffer_pool != nullptr ? size : 0;
+        ALOGI("%s Frame buffers resized to %d bytes for %dx%d, %d byte lines", __func__, size,
+              alloc_width, alloc_height, m_stride_align);
+    }
+    if (m_buffer_pool == nullptr) return AVERROR(ENOMEM);
+
+    frame->buf[0] = av_buffer_pool_get(m_buffer_pool);
+    if (frame->buf[0] == nullptr) return AVERROR(ENOMEM);
+
+    int ret = av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, format,
+                                   alloc_width, alloc_height, m_stride_align);
+    if (ret < 0) {
+        av_buffer_unref(&frame->buf[0]);
+        return ret;
+    }
+    return 0;
+}
+
+int CGFramePool::get_buffer(AVFrame *frame, AVPixelFormat format, int width, int height) {
+    std::lock_guard<std::mutex> lock(m_buffer_lock);
+    int ret = alloc_buffer(frame, format, width, height);
+    if (ret < 0) return ret;
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    return 0;
+}
+
+void CGFramePool::set_stride_align(int align) {
+    if (align <= 0 || (align & (align - 1)) != 0) {
+        ALOGW("%s Ignoring stride alignment %d, not a power of two", __func__, align);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_buffer_lock);
+    // Reallocated with the next buffer.
+    if (align != m_stride_align) {
+        m_stride_align = align;
+        m_buffer_size = 0;
+    }
+}
+
+int CGFramePool::get_video_buffer(AVCodecContext *ctx, AVFrame *frame, int flags) {
+    CGFramePool *pool = static_cast<CGFramePool *>(ctx->opaque);
+    if (pool == nullptr || frame->format != AV_PIX_FMT_YUV420P ||
+        !(ctx->codec->capabilities & AV_CODEC_CAP_DR1)) {
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+
+    // The codec writes up to its macroblock-aligned size; width and height
+    // stay what the stream says.
+    int alloc_width = frame->width;
+    int alloc_height = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(ctx, &alloc_width, &alloc_height, linesize_align);
+
+    std::lock_guard<std::mutex> lock(pool->m_buffer_lock);
+    if (linesize_align[0] > pool->m_stride_align) {
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+    return pool->alloc_buffer(frame, AVPixelFormat(frame->format), alloc_width, alloc_height);
+}
+
+//////// @class CGFrameQueue ////////
+
+CGFrameQueue::~CGFrameQueue() {
+    for (size_t i = m_head; i != m_tail; i++) {
+        av_frame_free(&m_frames[i % kCapacity]);
+    }
+}
+
+bool CGFrameQueue::push(AVFrame *frame) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) == kCapacity) {
+        return false;
+    }
+    m_frames[tail % kCapacity] = frame;
+    m_tail.store(tail + 1, std::memory_order_release);
+
+    // Taking the lock orders the store above before a consumer going to sleep
+    // re-checks the ring, so that the notification cannot be missed.
+    { std::lock_guard<std::mutex> lock(m_wait_lock); }
+    m_wait_cond.notify_one();
+    return true;
+}
+
+AVFrame *CGFrameQueue::pop_latest(CGFramePool &pool) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_acquire);
+    if (head == tail) return nullptr;
+
+    for (; head + 1 < tail; head++) {
+        pool.release(m_frames[head % kCapacity]);
+        m_frames[head % kCapacity] = nullptr;
+    }
+    AVFrame *frame = m_frames[head % kCapacity];
+    m_frames[head % kCapacity] = nullptr;
+    m_head.store(tail, std::memory_order_release);
+    return frame;
+}
+
+bool CGFrameQueue::wait(std::chrono::steady_clock::time_point deadline) {
+    if (!empty()) return true;
+    std::unique_lock<std::mutex> lock(m_wait_lock);
+    return m_wait_cond.wait_until(lock, deadline, [this] { return !empty(); });
+}
+
+void CGFrameQueue::clear(CGFramePool &pool) {
+    pool.release(pop_latest(pool));
+}
 //////// @class DecodeContext ////////
 
 struct DecodeContext {
     DecodeContext(int codec_type, int resolution_type);
-    virtual ~DecodeContext() = default;
+    virtual ~DecodeContext();
 
     AVCodecParserContext *parser;
     AVCodecContext *avcodec_ctx;
     AVPacket *packet;
+    CGHWAccelContex hw_accel_ctx;  // Referenced by avcodec_ctx->opaque
 
-    std::mutex mutex_;
-    std::vector<AVFrame *> decoded_frames;
+    bool is_hw_accel() const;
 
     // parameters by configuration
     int codec_type;
+    int resolution_type;
     std::pair<int, int> resolution;
 };
 
-DecodeContext::DecodeContext(int codec_type, int resolution_type) : codec_type(codec_type) {
+DecodeContext::DecodeContext(int codec_type, int resolution_type)
+    : codec_type(codec_type), resolution_type(resolution_type) {
     parser = nullptr;
     avcodec_ctx = nullptr;
     packet = nullptr;
@@ -100,27 +268,35 @@ DecodeContext::DecodeContext(int codec_type, int resolution_type) : codec_type(c
         resolution = std::make_pair(1280, 720);
     } else if (resolution_type == int(android::socket::FrameResolution::k1080p)) {
         resolution = std::make_pair(1920, 1080);
+    } else if (resolution_type == int(android::socket::FrameResolution::k2160p)) {
+        resolution = std::make_pair(3840, 2160);
     }
 
     ALOGD("Config decode type:%d width:%d height:%d\n", codec_type, resolution.first,
           resolution.second);
 }
 
+DecodeContext::~DecodeContext() {
+    av_parser_close(parser);
+    avcodec_free_context(&avcodec_ctx);
+    av_packet_free(&packet);
+}
+
 void DecodeContextDeleter::operator()(DecodeContext *p) { delete p; }
 
 //////// @class HWAccelContext ////////
 
 struct HWAccelContext {
+    // hw_dev_ctx is the device shared by all contexts, created on first use.
     HWAccelContext(const AVCodec *decoder, AVCodecContext *avcodec_ctx, const char *device_name,
-                   int extra_frames);
-    virtual ~HWAccelContext();
+                   AVBufferRef **hw_dev_ctx, int extra_frames);
+    virtual ~HWAccelContext() = default;
 
     AVPixelFormat get_hw_pixel_format() { return m_hw_pix_fmt; }
     bool is_hw_accel_valid() { return m_hw_accel_valid; }
 
 private:
     AVPixelFormat m_hw_pix_fmt = AV_PIX_FMT_NONE;
-    AVBufferRef *m_hw_dev_ctx = nullptr;
 
     bool m_hw_accel_valid = false;
 };
@@ -139,12 +315,13 @@ static enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelF
 }
 
 HWAccelContext::HWAccelContext(const AVCodec *decoder, AVCodecContext *avcodec_ctx,
-                               const char *device_name, int extra_frames) {
+                               const char *device_name, AVBufferRef **hw_dev_ctx,
+                               int extra_frames) {
     const char *device_prefix = "/dev/dri/renderD";
     char device[MAX_DEVICE_NAME_SIZE] = {'\0'};
     char prop_val[PROPERTY_VALUE_MAX] = {'\0'};
 
-    if (!decoder || !avcodec_ctx || !device_name || extra_frames < 0) {
+    if (!decoder || !avcodec_ctx || !device_name || !hw_dev_ctx || extra_frames < 0) {
         ALOGW("Invalid parameters for hw accel context.\n");
         return;
     }
@@ -169,53 +346,191 @@ HWAccelContext::HWAccelContext(const AVCodec *decoder, AVCodecContext *avcodec_c
         }
     }
 
+    if (*hw_dev_ctx == nullptr) {
+        property_get("ro.acg.rnode", prop_val, "0");
+        int count = snprintf(device, sizeof(device), "%s%d", device_prefix, 128 + atoi(prop_val));
+        if (count < 0 || count > MAX_DEVICE_NAME_SIZE) {
+            strcpy(device, "/dev/dri/renderD128");
+        }
+        ALOGI("%s - device: %s\n", __FUNCTION__, device);
+        if ((av_hwdevice_ctx_create(hw_dev_ctx, type, device, NULL, 0)) < 0) {
+            ALOGW("Failed to create specified HW device.\n");
+            return;
+        }
+    }
+    avcodec_ctx->hw_device_ctx = av_buffer_ref(*hw_dev_ctx);
+    if (avcodec_ctx->hw_device_ctx == nullptr) {
+        ALOGW("Failed to reference HW device.\n");
+        return;
+    }
+    // Only now that the device exists, as a SW fallback keeps avcodec_ctx.
     avcodec_ctx->opaque = this;
     avcodec_ctx->get_format = get_hw_format;
     avcodec_ctx->thread_count = 1;  // FIXME: vaapi decoder multi thread issue
     avcodec_ctx->extra_hw_frames = extra_frames;
     avcodec_ctx->hwaccel_flags |= AV_HWACCEL_FLAG_ALLOW_PROFILE_MISMATCH;
 
-    property_get("ro.acg.rnode", prop_val, "0");
-    int count = snprintf(device, sizeof(device), "%s%d", device_prefix, 128 + atoi(prop_val));
-    if (count < 0 || count > MAX_DEVICE_NAME_SIZE) {
-        strcpy(device, "/dev/dri/renderD128");
-    }
-    ALOGI("%s - device: %s\n", __FUNCTION__, device);
-    if ((av_hwdevice_ctx_create(&m_hw_dev_ctx, type, device, NULL, 0)) < 0) {
-        ALOGW("Failed to create specified HW device.\n");
-        return;
-    }
-    avcodec_ctx->hw_device_ctx = av_buffer_ref(m_hw_dev_ctx);
-
     m_hw_accel_valid = true;
 }
 
-HWAccelContext::~HWAccelContext() {
-    av_buffer_unref(&m_hw_dev_ctx);
-    m_hw_accel_valid = false;
+bool DecodeContext::is_hw_accel() const {
+    return hw_accel_ctx && hw_accel_ctx->is_hw_accel_valid();
 }
 
 void HWAccelContextDeleter::operator()(HWAccelContext *p) { delete p; }
 
 //////// @class CGVideoDecoder ////////
 
+const char *threading_to_str(CGDecodeThreading threading) {
+    switch (threading) {
+        case CGDecodeThreading::kSlice:
+            return "slice";
+        case CGDecodeThreading::kFrame:
+            return "frame";
+        case CGDecodeThreading::kAuto:
+            return "auto";
+        case CGDecodeThreading::kSingle:
+        default:
+            return "single";
+    }
+}
+
+void CGVideoDecoder::configure_sw_threading(AVCodecContext *c, int height) {
+    char prop_val[PROPERTY_VALUE_MAX] = {'\0'};
+    CGDecodeThreading mode = CGDecodeThreading::kAuto;
+
+    property_get("vendor.camera.decode.sw_threading", prop_val, "auto");
+    if (!strcmp(prop_val, "single")) {
+        mode = CGDecodeThreading::kSingle;
+    } else if (!strcmp(prop_val, "slice")) {
+        mode = CGDecodeThreading::kSlice;
+    } else if (!strcmp(prop_val, "frame")) {
+        mode = CGDecodeThreading::kFrame;
+    }
+
+    // Leave the other half of the cores to capture conversion by default.
+    property_get("vendor.camera.decode.sw_cores", prop_val, "0");
+    int cores = atoi(prop_val);
+    if (cores <= 0) {
+        cores = int(std::max(1L, sysconf(_SC_NPROCESSORS_ONLN) / 2));
+    }
+    cores = std::min(cores, MAX_SW_DECODE_THREADS);
+
+    if (mode == CGDecodeThreading::kAuto) {
+        // One core keeps up with 720p. 1080p does not, and clients rarely
+        // send more than one slice per frame, so frame threading is the only
+        // way to spread it, at the cost of a few frames of delay.
+        if (cores < 2) {
+            mode = CGDecodeThreading::kSingle;
+        } else if (height >= 1080 && cores >= 3) {
+            mode = CGDecodeThreading::kFrame;
+        } else {
+            mode = CGDecodeThreading::kSlice;
+        }
+    }
+
+    c->flags2 |= AV_CODEC_FLAG2_FAST;
+    switch (mode) {
+        case CGDecodeThreading::kFrame:
+            // AV_CODEC_FLAG_LOW_DELAY would turn frame threading off.
+            c->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+            c->thread_count = cores;
+            break;
+        case CGDecodeThreading::kSlice:
+            c->thread_type = FF_THREAD_SLICE;
+            c->thread_count = cores;
+            c->flags |= AV_CODEC_FLAG_LOW_DELAY;
+            break;
+        default:
+            c->thread_count = 1;
+            c->flags |= AV_CODEC_FLAG_LOW_DELAY;
+            break;
+    }
+    ALOGI("%s %s threading requested with %d threads", __func__, threading_to_str(mode),
+          c->thread_count);
+}
+
 CGVideoDecoder::~CGVideoDecoder() { destroy(); }
 
 bool CGVideoDecoder::can_decode() const { return decoder_ready; }
 
+static bool same_device(const char *a, const char *b) {
+    return a == b || (a != nullptr && b != nullptr && !strcmp(a, b));
+}
+
 int CGVideoDecoder::init(android::socket::FrameResolution resolution, uint32_t codec_type,
                          const char *device_name, int extra_hw_frames) {
     ALOGVV("%s E", __func__);
     std::lock_guard<std::recursive_mutex> decode_push_lock(push_lock);
     std::lock_guard<std::recursive_mutex> decode_pull_lock(pull_lock);
     decoder_ready = false;
+    park_context();
+
+    // Warm contexts and the device belong to the previous accelerator.
+    if (!same_device(device_name, this->device_name) || extra_hw_frames != this->extra_hw_frames) {
+        m_warm_contexts.clear();
+        av_buffer_unref(&m_hw_dev_ctx);
+    }
+
+    char prop_val[PROPERTY_VALUE_MAX] = {'\0'};
+    property_get("vendor.camera.decode.stride_align", prop_val, "64");
+    frame_pool->set_stride_align(atoi(prop_val));
+
+    property_get("vendor.camera.decode.conceal_max_frames", prop_val, "60");
+    m_conceal_max_frames = std::max(0, atoi(prop_val));
+    // A new stream starts with a keyframe.
+    m_awaiting_keyframe = false;
+    m_conceal_dropped = 0;
 
     // Update current init parameters which would be used during re-init.
     this->codec_type = codec_type;
     this->resolution = resolution;
     this->device_name = device_name;
+    this->extra_hw_frames = extra_hw_frames;
+
+    for (auto it = m_warm_contexts.begin(); it != m_warm_contexts.end(); ++it) {
+        if ((*it)->codec_type == int(codec_type) && (*it)->resolution_type == int(resolution)) {
+            m_decode_ctx = std::move(*it);
+            m_warm_contexts.erase(it);
+            ALOGI("%s Reusing warm decoder for type:%d %dx%d", __func__, codec_type,
+                  m_decode_ctx->resolution.first, m_decode_ctx->resolution.second);
+            break;
+        }
+    }
+    if (!m_decode_ctx) {
+        m_decode_ctx = create_context();
+        if (!m_decode_ctx) return -1;
+    }
+
+    // What the codec actually does, which depends on the stream and build.
+    AVCodecContext *c = m_decode_ctx->avcodec_ctx;
+    if (c->active_thread_type & FF_THREAD_FRAME) {
+        m_threading = CGDecodeThreading::kFrame;
+        m_frame_delay = c->thread_count - 1;
+    } else {
+        m_threading = (c->active_thread_type & FF_THREAD_SLICE) ? CGDecodeThreading::kSlice
+                                                                : CGDecodeThreading::kSingle;
+        m_frame_delay = 0;
+    }
+    m_threads = c->thread_count;
+    ALOGI("%s Decoding with %s threading, %d threads, %d frames of delay", __func__,
+          threading_to_str(m_threading), c->thread_count, m_frame_delay.load());
 
-    m_decode_ctx = CGDecContex(new DecodeContext(int(codec_type), int(resolution)));
+    decoder_ready = true;
+    return 0;
+}
+
+int CGVideoDecoder::reconfigure(android::socket::FrameResolution resolution,
+                                uint32_t codec_type) {
+    std::lock_guard<std::recursive_mutex> decode_push_lock(push_lock);
+    if (decoder_ready && resolution == this->resolution && codec_type == this->codec_type) {
+        return 0;
+    }
+    return init(resolution, codec_type, device_name, extra_hw_frames);
+}
+
+CGDecContex CGVideoDecoder::create_context() {
+    CGDecContex ctx(new DecodeContext(int(codec_type), int(resolution)));
 
     AVCodecID codec_id = (codec_type == int(android::socket::VideoCodecType::kH265))
                              ? AV_CODEC_ID_H265
@@ -224,57 +539,89 @@ int CGVideoDecoder::init(android::socket::FrameResolution resolution, uint32_t c
     const AVCodec *codec = avcodec_find_decoder(codec_id);
     if (codec == nullptr) {
         ALOGW("Codec id:%d not found!", codec_id);
-        return -1;
+        return nullptr;
     }
 
-    AVCodecParserContext *parser = av_parser_init(codec->id);
-    if (parser == nullptr) {
+    ctx->parser = av_parser_init(codec->id);
+    if (ctx->parser == nullptr) {
         ALOGW("Parser not found!");
-        return -1;
+        return nullptr;
     }
 
-    AVCodecContext *c = avcodec_alloc_context3(codec);
-    if (c == nullptr) {
+    ctx->avcodec_ctx = avcodec_alloc_context3(codec);
+    if (ctx->avcodec_ctx == nullptr) {
         ALOGW("Could not allocate video codec context\n");
-        av_parser_close(parser);
-        return -1;
+        return nullptr;
     }
+    AVCodecContext *c = ctx->avcodec_ctx;
 
     if (device_name != nullptr) {
-        m_hw_accel_ctx =
-            CGHWAccelContex(new HWAccelContext(codec, c, device_name, extra_hw_frames));
-        if (m_hw_accel_ctx->is_hw_accel_valid()) {
+        ctx->hw_accel_ctx = CGHWAccelContex(
+            new HWAccelContext(codec, c, device_name, &m_hw_dev_ctx, extra_hw_frames));
+        if (ctx->is_hw_accel()) {
             ALOGI("%s Use device %s to accelerate decoding!", __func__, device_name);
         } else {
             ALOGW("%s System doesn't support VAAPI(Video Acceleration API). SW Decoding is used.!",
                   __func__);
         }
     }
+    if (!ctx->is_hw_accel()) {
+        // Nothing of a failed HW setup may outlive it: get_format would take
+        // the pool below for the HW context.
+        c->get_format = avcodec_default_get_format;
+        av_buffer_unref(&c->hw_device_ctx);
+        c->extra_hw_frames = 0;
+        ctx->hw_accel_ctx.reset();
+        configure_sw_threading(c, ctx->resolution.second);
+        // Decode into pooled buffers with the output stride; the pool is shared
+        // with the frames handed out and outlives the context.
+        c->opaque = frame_pool.get();
+        c->get_buffer2 = CGFramePool::get_video_buffer;
+        c->thread_safe_callbacks = 1;
+    }
 
-    AVPacket *pkt = av_packet_alloc();
-    if (pkt == nullptr) {
+    ctx->packet = av_packet_alloc();
+    if (ctx->packet == nullptr) {
         ALOGW("Could not allocate packet\n");
-        av_parser_close(parser);
-        avcodec_free_context(&c);
-        return -1;
+        return nullptr;
     }
 
     if (avcodec_open2(c, codec, NULL) < 0) {
         ALOGW("Could not open codec\n");
-        av_parser_close(parser);
-        avcodec_free_context(&c);
-        av_packet_free(&pkt);
-        return -1;
+        return nullptr;
     }
+    return ctx;
+}
 
-    m_decode_ctx->parser = parser;
-    m_decode_ctx->avcodec_ctx = c;
-    m_decode_ctx->packet = pkt;
-    decoder_ready = true;
+int CGVideoDecoder::reset_context(DecodeContext *ctx) {
+    avcodec_flush_buffers(ctx->avcodec_ctx);
+    av_packet_unref(ctx->packet);
+    // The parser may hold a partial access unit of the old stream.
+    av_parser_close(ctx->parser);
+    ctx->parser = av_parser_init(ctx->avcodec_ctx->codec_id);
+    if (ctx->parser == nullptr) {
+        ALOGW("%s Parser not found!", __func__);
+        return -1;
+    }
     return 0;
 }
 
-int CGVideoDecoder::decode(const uint8_t *data, int data_size) {
+void CGVideoDecoder::park_context() {
+    decoded_frames.clear(*frame_pool);
+    if (!m_decode_ctx) return;
+
+    CGDecContex ctx = std::move(m_decode_ctx);
+    if (reset_context(ctx.get()) < 0) return;
+
+    // Evict the least recently used context.
+    if (m_warm_contexts.size() == MAX_WARM_DECODE_CONTEXTS) {
+        m_warm_contexts.erase(m_warm_contexts.begin());
+    }
+    m_warm_contexts.push_back(std::move(ctx));
+}
+
+int CGVideoDecoder::decode(const uint8_t *data, int data_size, uint64_t sequence,
+                           int64_t capture_time_ns) {
     ALOGVV("%s E", __func__);
     std::lock_guard<std::recursive_mutex> decode_access_lock(push_lock);
     if (!can_decode()) {
@@ -292,8 +639,10 @@ int CGVideoDecoder::decode(const uint8_t *data, int data_size) {
 
     while (data_size > 0) {
         ALOGVV("%s data_size: %d\n", __func__, data_size);
+        // The frame info travels in pts and pos, which the decoder copies to its output.
         int ret = av_parser_parse2(parser, m_decode_ctx->avcodec_ctx, &pkt->data, &pkt->size, data,
-                                   data_size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+                                   data_size, capture_time_ns ? capture_time_ns : AV_NOPTS_VALUE,
+                                   AV_NOPTS_VALUE, int64_t(sequence));
         if (ret < 0) {
             ALOGW("%s Error while parsing\n", __func__);
             return -1;
@@ -305,16 +654,12 @@ int CGVideoDecoder::decode(const uint8_t *data, int data_size) {
         data_size -= ret;
 
         if (pkt->size) {
+            pkt->pts = parser->pts;
+            pkt->pos = parser->pos;
             if (decode_one_frame(pkt) == AVERROR_INVALIDDATA) {
-                ALOGI("%s re-init", __func__);
-                flush_decoder();
-                destroy();
-                if (init((android::socket::FrameResolution)this->resolution, this->codec_type,
-                         this->device_name, 0) < 0) {
-                    ALOGE("%s re-init failed. %s decoding", __func__, device_name);
+                if (recover() < 0) {
                     return -1;
                 } else {
-                    pkt = m_decode_ctx->packet;
                     parser = m_decode_ctx->parser;
                     continue;
                 }
@@ -326,6 +671,59 @@ int CGVideoDecoder::decode(const uint8_t *data, int data_size) {
     return 0;
 }
 
+int CGVideoDecoder::decode_access_unit(const uint8_t *data, int data_size,
+                                       void (*release)(void *opaque, uint8_t *data),
+                                       void *opaque, uint64_t sequence,
+                                       int64_t capture_time_ns) {
+    ALOGVV("%s E", __func__);
+    std::lock_guard<std::recursive_mutex> decode_access_lock(push_lock);
+    uint8_t *buffer = const_cast<uint8_t *>(data);
+    if (!can_decode() || data == nullptr || data_size <= 0) {
+        ALOGE("%s Decoder not initialized or invalid args: data: %p, data_size: %d", __func__,
+              data, data_size);
+        release(opaque, buffer);
+        return -1;
+    }
+
+    AVPacket *pkt = m_decode_ctx->packet;
+    pkt->buf = av_buffer_create(buffer, data_size, release, opaque, AV_BUFFER_FLAG_READONLY);
+    if (pkt->buf == nullptr) {
+        ALOGW("%s Could not wrap input buffer\n", __func__);
+        release(opaque, buffer);
+        return -1;
+    }
+    pkt->data = buffer;
+    pkt->size = data_size;
+    pkt->pts = capture_time_ns ? capture_time_ns : AV_NOPTS_VALUE;
+    pkt->pos = int64_t(sequence);
+
+    int ret = decode_one_frame(pkt);
+    // The codec took its own reference if it still needs the data.
+    av_packet_unref(pkt);
+    if (ret == AVERROR_INVALIDDATA) {
+        return recover();
+    }
+
+    ALOGVV("%s X", __func__);
+    return ret < 0 ? -1 : 0;
+}
+
+int CGVideoDecoder::recover() {
+    ALOGI("%s Flushing decoder after invalid data", __func__);
+    if (reset_context(m_decode_ctx.get()) < 0) {
+        ALOGE("%s Recovery failed. %s decoding", __func__, device_name);
+        decoder_ready = false;
+        return -1;
+    }
+    return 0;
+}
+
+void CGVideoDecoder::conceal_until_keyframe() {
+    if (m_conceal_max_frames > 0 && !m_awaiting_keyframe.exchange(true)) {
+        ALOGI("%s Holding the last good frame until the next keyframe", __func__);
+    }
+}
+
 int CGVideoDecoder::decode_one_frame(const AVPacket *pkt) {
     ALOGVV("%s E", __func__);
     AVCodecContext *c = m_decode_ctx->avcodec_ctx;
@@ -333,6 +731,7 @@ int CGVideoDecoder::decode_one_frame(const AVPacket *pkt) {
     int sent = avcodec_send_packet(c, pkt);
     if (sent < 0) {
         ALOGE("%s Error sending a packet for decoding: %s\n", __func__, av_err2str(sent));
+        conceal_until_keyframe();
         return sent;
     }
 
@@ -340,7 +739,7 @@ int CGVideoDecoder::decode_one_frame(const AVPacket *pkt) {
     AVFrame *frame = nullptr;
     while (decode_stat >= 0) {
         if (frame == nullptr) {
-            frame = av_frame_alloc();
+            frame = frame_pool->acquire();
             if (frame == nullptr) {
                 ALOGW("Could not allocate video frame\n");
                 return -1;
@@ -352,7 +751,8 @@ int CGVideoDecoder::decode_one_frame(const AVPacket *pkt) {
             break;
         } else if (decode_stat < 0) {
             ALOGW("Error during decoding\n");
-            av_frame_free(&frame);
+            frame_pool->release(frame);
+            conceal_until_keyframe();
             return -1;
         }
         // video info sanity check
@@ -365,43 +765,83 @@ int CGVideoDecoder::decode_one_frame(const AVPacket *pkt) {
             if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_VAAPI)
                 ALOGW("%s: Camera input frame format %d is not matching with Decoder format",
                       __func__, frame->format);
-            av_frame_free(&frame);
+            frame_pool->release(frame);
             return -1;
         }
 
-        if (m_hw_accel_ctx.get() && m_hw_accel_ctx->is_hw_accel_valid()) {
-            AVFrame *sw_frame = av_frame_alloc();
-            if (sw_frame == nullptr) {
-                ALOGW("Could not allocate video frame\n");
-                return -1;
+        // Drop frames built on lost references before downloading them.
+        bool corrupt = frame->decode_error_flags || (frame->flags & AV_FRAME_FLAG_CORRUPT);
+        if (corrupt) {
+            conceal_until_keyframe();
+        }
+        if (m_awaiting_keyframe) {
+            if (frame->key_frame && !corrupt) {
+                ALOGI("%s Keyframe decoded after %d concealed frames", __func__,
+                      m_conceal_dropped);
+                m_awaiting_keyframe = false;
+                m_conceal_dropped = 0;
+            } else if (++m_conceal_dropped > m_conceal_max_frames) {
+                ALOGW("%s No keyframe within %d frames, showing decoded frames again",
+                      __func__, m_conceal_max_frames.load());
+                m_awaiting_keyframe = false;
+                m_conceal_dropped = 0;
+            } else {
+                m_concealed_frames++;
+                av_frame_unref(frame);
+                continue;
             }
+        }
 
-            if (frame->format != m_hw_accel_ctx->get_hw_pixel_format()) {
+        if (m_decode_ctx->is_hw_accel()) {
+            if (frame->format != m_decode_ctx->hw_accel_ctx->get_hw_pixel_format() ||
+                frame->hw_frames_ctx == nullptr) {
                 ALOGW("Decoder HW format mismatch\n");
+                frame_pool->release(frame);
                 return -1;
             }
 
-            /* retrieve data from GPU to CPU */
-            int ret = av_hwframe_transfer_data(sw_frame, frame, 0);
+            // Consumers expect 8 bit NV12, e.g. not the P010 of H265 Main10.
+            AVHWFramesContext *frames_ctx =
+                reinterpret_cast<AVHWFramesContext *>(frame->hw_frames_ctx->data);
+            if (frames_ctx->sw_format != AV_PIX_FMT_NV12) {
+                ALOGW("%s: Decoded surface format %d is not supported", __func__,
+                      frames_ctx->sw_format);
+                frame_pool->release(frame);
+                return -1;
+            }
+
+            /* retrieve data from GPU to CPU, into a pooled buffer */
+            AVFrame *sw_frame = frame_pool->acquire();
+            int ret = sw_frame != nullptr ? frame_pool->get_buffer(sw_frame, frames_ctx->sw_format,
+                                                                  frame->width, frame->height)
+                                          : AVERROR(ENOMEM);
+            if (ret == 0) {
+                ret = av_hwframe_transfer_data(sw_frame, frame, 0);
+            }
+            if (ret >= 0) {
+                // Keeps pts and pkt_pos, i.e. the client frame info.
+                ret = av_frame_copy_props(sw_frame, frame);
+            }
+            frame_pool->release(frame);
             if (ret < 0) {
                 ALOGE("Error transferring the data to system memory: %s\n", av_err2str(ret));
+                frame_pool->release(sw_frame);
                 return -1;
             }
-
-            av_frame_free(&frame);
             frame = sw_frame;
         } else
             ALOGVV("%s Camera VHAL uses SW decoding", __func__);
 
-        // push decoded frame
-        {
-            std::lock_guard<std::mutex> lock(m_decode_ctx->mutex_);
-            m_decode_ctx->decoded_frames.push_back(frame);
+        // push decoded frame; if the sensor fell that far behind, drop it
+        if (decoded_frames.push(frame)) {
             frame = nullptr;
+        } else {
+            ALOGW("%s Decoded frame queue is full, dropping frame", __func__);
+            av_frame_unref(frame);
         }
     }
 
-    av_frame_free(&frame);
+    frame_pool->release(frame);
     ALOGVV("%s X", __func__);
     return 0;
 }
@@ -412,29 +852,35 @@ int CGVideoDecoder::get_decoded_frame(CGVideoFrame::Ptr cg_frame) {
         ALOGE("%s Decoder not initialized", __func__);
         return -1;
     }
-    std::lock_guard<std::mutex> lock(m_decode_ctx->mutex_);
 
-    if (m_decode_ctx->decoded_frames.empty()) return -1;
+    AVFrame *frame = decoded_frames.pop_latest(*frame_pool);
+    if (frame == nullptr) return -1;
 
-    while (m_decode_ctx->decoded_frames.size() > MAX_ALLOWED_PENDING_FRAMES) {
-        auto it = m_decode_ctx->decoded_frames.begin();
-        AVFrame *frame = *it;
-        av_frame_free(&frame);
-        m_decode_ctx->decoded_frames.erase(it);
+    cg_frame->move_frame(frame);
+    frame_pool->release(frame);
+    return 0;
+}
+
+CGVideoFrame::Ptr CGVideoDecoder::acquire_frame(std::chrono::steady_clock::time_point deadline) {
+    // Not under pull_lock: destroy() must not have to wait for the deadline.
+    if (!decoded_frames.wait(deadline)) {
+        return nullptr;
     }
-    // return the frame in the front
-    auto it = m_decode_ctx->decoded_frames.begin();
-    AVFrame *frame = *it;
-    cg_frame->ref_frame(frame);
-    av_frame_free(&frame);
-    m_decode_ctx->decoded_frames.erase(it);
 
-    return 0;
+    std::lock_guard<std::recursive_mutex> decode_access_lock(pull_lock);
+    if (!can_decode()) {
+        ALOGE("%s Decoder not initialized", __func__);
+        return nullptr;
+    }
+    AVFrame *frame = decoded_frames.pop_latest(*frame_pool);
+    if (frame == nullptr) return nullptr;
+    return std::make_shared<CGVideoFrame>(frame, frame_pool);
 }
 
 /* flush the decoder */
 int CGVideoDecoder::flush_decoder() {
     std::lock_guard<std::recursive_mutex> decode_push_lock(push_lock);
+    if (!m_decode_ctx) return -1;
     AVCodecContext *c = m_decode_ctx->avcodec_ctx;
     AVPacket *packet = m_decode_ctx->packet;
 
@@ -452,23 +898,23 @@ int CGVideoDecoder::flush_decoder() {
     return 0;
 }
 
+int CGVideoDecoder::close() {
+    std::lock_guard<std::recursive_mutex> decode_push_lock(push_lock);
+    std::lock_guard<std::recursive_mutex> decode_pull_lock(pull_lock);
+    decoder_ready = false;
+    park_context();
+    return 0;
+}
+
 int CGVideoDecoder::destroy() {
     std::lock_guard<std::recursive_mutex> decode_push_lock(push_lock);
     std::lock_guard<std::recursive_mutex> decode_pull_lock(pull_lock);
     decoder_ready = false;
-    av_parser_close(m_decode_ctx->parser);
-    avcodec_free_context(&m_decode_ctx->avcodec_ctx);
-    av_packet_free(&m_decode_ctx->packet);
-
-    if (!m_decode_ctx->decoded_frames.empty()) {
-        std::lock_guard<std::mutex> lock(m_decode_ctx->mutex_);
-        for (auto frame : m_decode_ctx->decoded_frames) {
-            av_frame_free(&frame);
-        }
-        m_decode_ctx->decoded_frames.clear();
-    }
-    m_hw_accel_ctx.reset();
+
+    decoded_frames.clear(*frame_pool);
     m_decode_ctx.reset();
+    m_warm_contexts.clear();
+    av_buffer_unref(&m_hw_dev_ctx);
 
     return 0;
 }
@@ -43,6 +43,14 @@ const char* camera_type_to_str(int type) {
             return "CAMERA_DATA";
         case ACK:
             return "ACK";
+        case CAMERA_INFO:
+            return "CAMERA_INFO";
+        case CAMERA_SHM_CONFIG:
+            return "CAMERA_SHM_CONFIG";
+        case CAMERA_CLOCK_SYNC:
+            return "CAMERA_CLOCK_SYNC";
+        case CAMERA_REQUEST_KEYFRAME:
+            return "CAMERA_REQUEST_KEYFRAME";
         default:
             return "invalid";
     }
@@ -67,6 +75,8 @@ const char* resolution_to_str(uint32_t resolution) {
             return "720p";
         case int(android::socket::FrameResolution::k1080p):
             return "1080p";
+        case int(android::socket::FrameResolution::k2160p):
+            return "2160p";
         default:
             return "invalid";
     }
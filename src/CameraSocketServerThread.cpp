@@ -31,17 +31,22 @@
 #include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <algorithm>
 #include <array>
 #include <atomic>
 
 #include <errno.h>
+#include <inttypes.h>
 #include <netinet/in.h>
-#include <poll.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <time.h>
+#include <utils/Timers.h>
 #include "CameraSocketServerThread.h"
 #include "VirtualBuffer.h"
 #include "VirtualCameraFactory.h"
@@ -71,12 +76,24 @@ bool gStartMetadataUpdate;
 bool gDoneMetadataUpdate;
 
 using namespace socket;
+
+// Minimum time between two keyframe requests.
+static int64_t getKeyframeRequestIntervalNs() {
+    char prop_val[PROPERTY_VALUE_MAX] = {'\0'};
+    property_get("vendor.camera.keyframe_request_interval_ms", prop_val, "500");
+    int interval_ms = atoi(prop_val);
+    return int64_t(interval_ms > 0 ? interval_ms : 0) * 1000000;
+}
+
 #ifdef ENABLE_FFMPEG
 CameraSocketServerThread::CameraSocketServerThread(std::string suffix,
         std::shared_ptr<CGVideoDecoder> decoder,
         std::atomic<CameraSessionState> &state)
     : Thread(/*canCallJava*/ false), mRunning{true}, mSocketServerFd{-1},
-      mVideoDecoder{decoder}, mCameraSessionState{state} {
+      mVideoDecoder{decoder},
+      mDecoderThread{new DecoderThread(decoder, ClientVideoBuffer::kDecodeQueueDepth,
+                                       [this] { postControlEvent(kControlRequestKeyframe); })},
+      mCameraSessionState{state} {
 #else
 CameraSocketServerThread::CameraSocketServerThread(std::string suffix,
         std::atomic<CameraSessionState> &state)
@@ -84,6 +101,10 @@ CameraSocketServerThread::CameraSocketServerThread(std::string suffix,
       mCameraSessionState{state} {
 #endif
     pthread_t threadId;
+    mControlFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mControlFd < 0) {
+        ALOGE(LOG_TAG "%s: Failed to create control eventfd: %s", __FUNCTION__, strerror(errno));
+    }
     std::string sock_path = "/ipc/camera-socket" + suffix;
     char *k8s_env_value = getenv("K8S_ENV");
     mSocketPath = (k8s_env_value != NULL && !strcmp(k8s_env_value, "true")) ? "/conn/camera-socket"
@@ -96,6 +117,10 @@ CameraSocketServerThread::CameraSocketServerThread(std::string suffix,
 }
 
 CameraSocketServerThread::~CameraSocketServerThread() {
+#ifdef ENABLE_FFMPEG
+    // Stop decoding first: the decoder thread posts to mControlFd.
+    mDecoderThread.reset();
+#endif
     if (mClientFd > 0) {
         shutdown(mClientFd, SHUT_RDWR);
         close(mClientFd);
@@ -105,6 +130,18 @@ CameraSocketServerThread::~CameraSocketServerThread() {
         close(mSocketServerFd);
         mSocketServerFd = -1;
     }
+    if (mEpollFd >= 0) {
+        close(mEpollFd);
+        mEpollFd = -1;
+    }
+    if (mControlFd >= 0) {
+        close(mControlFd);
+        mControlFd = -1;
+    }
+    if (mShmFd >= 0) {
+        close(mShmFd);
+        mShmFd = -1;
+    }
 }
 
 status_t CameraSocketServerThread::requestExitAndWait() {
@@ -117,14 +154,31 @@ int CameraSocketServerThread::getClientFd() {
     return mClientFd;
 }
 
-void CameraSocketServerThread::requestExit() {
+void CameraSocketServerThread::setClientFd(int fd) {
     Mutex::Autolock al(mMutex);
+    mClientFd = fd;
+}
 
-    ALOGV("%s: Requesting thread exit", __FUNCTION__);
-    mRunning = false;
+void CameraSocketServerThread::requestExit() {
+    {
+        Mutex::Autolock al(mMutex);
+
+        ALOGV("%s: Requesting thread exit", __FUNCTION__);
+        mRunning = false;
+    }
+    // Wake the reactor so that exit does not wait for socket activity.
+    postControlEvent(kControlExit);
     ALOGV("%s: Request exit complete.", __FUNCTION__);
 }
 
+void CameraSocketServerThread::postControlEvent(ControlEvent event) {
+    mPendingControl.fetch_or(event);
+    uint64_t one = 1;
+    if (mControlFd >= 0 && write(mControlFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        ALOGE(LOG_TAG "%s: Failed to signal control eventfd: %s", __FUNCTION__, strerror(errno));
+    }
+}
+
 status_t CameraSocketServerThread::readyToRun() {
     Mutex::Autolock al(mMutex);
 
@@ -158,6 +212,10 @@ void CameraSocketServerThread::setCameraResolution(uint32_t resolution) {
             gCameraMaxWidth = 1920;
             gCameraMaxHeight = 1080;
             break;
+        case uint32_t(FrameResolution::k2160p):
+            gCameraMaxWidth = 3840;
+            gCameraMaxHeight = 2160;
+            break;
         default:
             break;
     }
@@ -186,8 +244,10 @@ bool CameraSocketServerThread::configureCapabilities(bool skipCapRead) {
     camera_packet_t *ack_packet = NULL;
     camera_header_t header = {};
     if(!skipCapRead) {
-        if ((recv_size = recv(mClientFd, (char *)&header, sizeof(camera_header_t), MSG_WAITALL)) < 0) {
-            ALOGE(LOG_TAG "%s: Failed to receive header, err: %s ", __FUNCTION__, strerror(errno));
+        if ((recv_size = recv(mClientFd, (char *)&header, sizeof(camera_header_t), MSG_WAITALL)) !=
+            ssize_t(sizeof(camera_header_t))) {
+            ALOGE(LOG_TAG "%s: Failed to receive header, err: %s ", __FUNCTION__,
+                  recv_size < 0 ? strerror(errno) : "timed out or closed");
             goto out;
         }
 
@@ -209,6 +269,12 @@ bool CameraSocketServerThread::configureCapabilities(bool skipCapRead) {
     capability.codec_type = (uint32_t)VideoCodecType::kAll;
     capability.resolution = (uint32_t)FrameResolution::kAll;
     capability.maxNumberOfCameras = MAX_NUMBER_OF_SUPPORTED_CAMERAS;
+    // SCM_RIGHTS is only available on UNIX sockets.
+    capability.reserved[0] = CAMERA_TRANSPORT_AU_ALIGNED;
+    if (mTransMode == UNIX) {
+        capability.reserved[0] |= CAMERA_TRANSPORT_SHM;
+    }
+    capability.reserved[1] = CAMERA_PROTOCOL_VERSION_3;
 
     memcpy(cap_packet->payload, &capability, sizeof(camera_capability_t));
     if (send(mClientFd, cap_packet, cap_packet_size, 0) < 0) {
@@ -218,8 +284,10 @@ bool CameraSocketServerThread::configureCapabilities(bool skipCapRead) {
     }
     ALOGI(LOG_TAG "%s: Sent CAPABILITY packet to client", __FUNCTION__);
 
-    if ((recv_size = recv(mClientFd, (char *)&header, sizeof(camera_header_t), MSG_WAITALL)) < 0) {
-        ALOGE(LOG_TAG "%s: Failed to receive header, err: %s ", __FUNCTION__, strerror(errno));
+    if ((recv_size = recv(mClientFd, (char *)&header, sizeof(camera_header_t), MSG_WAITALL)) !=
+        ssize_t(sizeof(camera_header_t))) {
+        ALOGE(LOG_TAG "%s: Failed to receive header, err: %s ", __FUNCTION__,
+              recv_size < 0 ? strerror(errno) : "timed out or closed");
         goto out;
     }
 
@@ -251,8 +319,10 @@ bool CameraSocketServerThread::configureCapabilities(bool skipCapRead) {
         gMaxNumOfCamerasSupported = mNumOfCamerasRequested;
     }
     if ((recv_size = recv(mClientFd, (char *)&camera_info,
-                          mNumOfCamerasRequested * sizeof(camera_info_t), MSG_WAITALL)) < 0) {
-        ALOGE(LOG_TAG "%s: Failed to receive camera info, err: %s ", __FUNCTION__, strerror(errno));
+                          mNumOfCamerasRequested * sizeof(camera_info_t), MSG_WAITALL)) !=
+        ssize_t(mNumOfCamerasRequested * sizeof(camera_info_t))) {
+        ALOGE(LOG_TAG "%s: Failed to receive camera info, err: %s ", __FUNCTION__,
+              recv_size < 0 ? strerror(errno) : "timed out or closed");
         goto out;
     }
 
@@ -260,6 +330,29 @@ bool CameraSocketServerThread::configureCapabilities(bool skipCapRead) {
           recv_size);
     ALOGI(LOG_TAG "%s: Number of cameras requested = %d", __FUNCTION__, mNumOfCamerasRequested);
 
+    mShmRing = nullptr;
+    mShmTransport = mTransMode == UNIX && (camera_info[0].reserved[0] & CAMERA_TRANSPORT_SHM) &&
+                    camera_info[0].codec_type == uint32_t(VideoCodecType::kI420);
+    ALOGI(LOG_TAG "%s: Shared memory transport %s", __FUNCTION__,
+          mShmTransport ? "enabled" : "disabled");
+
+#ifdef ENABLE_FFMPEG
+    mDecoderThread->setAccessUnitAligned(
+        (camera_info[0].reserved[0] & CAMERA_TRANSPORT_AU_ALIGNED) &&
+        (camera_info[0].codec_type == uint32_t(VideoCodecType::kH264) ||
+         camera_info[0].codec_type == uint32_t(VideoCodecType::kH265)));
+    ALOGI(LOG_TAG "%s: Access unit aligned input %s", __FUNCTION__,
+          mDecoderThread->accessUnitAligned() ? "enabled" : "disabled");
+#endif
+
+    mProtocolVersion = (camera_info[0].reserved[1] == CAMERA_PROTOCOL_VERSION_3)
+                           ? CAMERA_PROTOCOL_VERSION_3
+                           : CAMERA_PROTOCOL_VERSION_LEGACY;
+    mLastSequence = 0;
+    mClockRttNs = -1;
+    mKeyframeRequestIntervalNs = getKeyframeRequestIntervalNs();
+    mLastKeyframeRequestNs = 0;
+    ALOGI(LOG_TAG "%s: Using data protocol version %u", __FUNCTION__, mProtocolVersion);
 
     gVirtualCameraFactory.constructVirtualCamera();
     // validate capability info received from the client.
@@ -281,6 +374,10 @@ bool CameraSocketServerThread::configureCapabilities(bool skipCapRead) {
                 gIsInFrameH264 = true;
                 val_client_cap[i].validCodecType = true;
                 break;
+            case uint32_t(VideoCodecType::kH265):
+                gIsInFrameH265 = true;
+                val_client_cap[i].validCodecType = true;
+                break;
             case uint32_t(VideoCodecType::kI420):
                 gIsInFrameI420 = true;
                 val_client_cap[i].validCodecType = true;
@@ -298,6 +395,7 @@ bool CameraSocketServerThread::configureCapabilities(bool skipCapRead) {
             case uint32_t(FrameResolution::k480p):
             case uint32_t(FrameResolution::k720p):
             case uint32_t(FrameResolution::k1080p):
+            case uint32_t(FrameResolution::k2160p):
                 val_client_cap[i].validResolution = true;
                 break;
             default:
@@ -438,6 +536,12 @@ bool CameraSocketServerThread::configureCapabilities(bool skipCapRead) {
     ALOGI(LOG_TAG "%s: Sent ACK packet to client with ack_size: %zu ", __FUNCTION__,
           ack_packet_size);
 
+    if (mProtocolVersion == CAMERA_PROTOCOL_VERSION_3) {
+        // Replies are handled along with the frames once streaming started.
+        mClockSyncSamples = 0;
+        sendClockSync();
+    }
+
     status = true;
 out:
     free(ack_packet);
@@ -446,435 +550,920 @@ out:
     return status;
 }
 
+void CameraSocketServerThread::dump(int fd) {
+    dprintf(fd, "Camera client protocol version %u:\n", mProtocolVersion);
+    if (mClockRttNs >= 0) {
+        dprintf(fd, "  clock offset: %" PRId64 " ns (round trip %" PRId64 " ns)\n",
+                mClockOffsetNs.load(), mClockRttNs.load());
+        dprintf(fd, "  capture to received: last %" PRId64 " us, max %" PRId64 " us\n",
+                mLastLatencyNs / 1000, mMaxLatencyNs / 1000);
+    } else {
+        dprintf(fd, "  clock offset: unknown\n");
+    }
+    dprintf(fd, "  frames lost: %" PRIu64 "\n", mFramesLost.load());
+    dprintf(fd, "  stale frames dropped: %" PRIu64 "\n", mFramesStale.load());
+    dprintf(fd, "  keyframe requests: %" PRIu64 " sent, %" PRIu64 " rate limited\n",
+            mKeyframeRequests.load(), mKeyframeRequestsLimited.load());
+#ifdef ENABLE_FFMPEG
+    dprintf(fd, "Decoder queue: depth %zu (max %zu of %zu)\n", mDecoderThread->queueDepth(),
+            mDecoderThread->maxQueueDepth(), ClientVideoBuffer::kDecodeQueueDepth);
+    dprintf(fd, "  decoded: %" PRIu64 ", errors: %" PRIu64 ", dropped: %" PRIu64 "\n",
+            mDecoderThread->decoded(), mDecoderThread->errors(), mDecoderThread->dropped());
+    dprintf(fd, "  concealed frames: %" PRIu64 "%s\n", mVideoDecoder->concealed_frames(),
+            mVideoDecoder->awaiting_keyframe() ? ", awaiting keyframe" : "");
+    dprintf(fd, "  input: %s\n",
+            mDecoderThread->accessUnitAligned() ? "access units" : "parsed stream");
+    dprintf(fd, "  threading: %s, %d threads, +%d frames of delay\n",
+            threading_to_str(mVideoDecoder->threading()), mVideoDecoder->threads(),
+            mVideoDecoder->frame_delay());
+#endif
+}
+
 bool CameraSocketServerThread::threadLoop() {
     return true;
 }
-#define SIZE_FRAME_MAX              (4294967295U)
 
-void* CameraSocketServerThread::threadFunc(void *arg) {
-    struct sockaddr_un addr_un;
-    CameraSocketServerThread *threadParam = (CameraSocketServerThread *)arg;
-    memset(&addr_un, 0, sizeof(addr_un));
-    addr_un.sun_family = AF_UNIX;
-    int ret = 0;
-    int new_client_fd =-1;
-    int so_reuseaddr = 1;
-    struct sockaddr_vm addr_vm ;
+bool CameraSocketServerThread::setupServerSocket() {
+    struct sockaddr_vm addr_vm;
     struct sockaddr_in addr_ip;
-    int trans_mode = 0;
     char mode[PROPERTY_VALUE_MAX];
 
     if ((property_get("ro.vendor.camera.transference", mode, nullptr) > 0) ){
         if (!strcmp(mode, "TCP")) {
-            trans_mode = TCP;
+            mTransMode = TCP;
         }else if (!strcmp(mode, "UNIX")) {
-            trans_mode = UNIX;
+            mTransMode = UNIX;
         }else if (!strcmp(mode, "VSOCK")) {
-            trans_mode = VSOCK;
+            mTransMode = VSOCK;
         }
     }
     else{
        //Fall back to unix socket by default
-       //trans_mode = UNIX;
+       //mTransMode = UNIX;
        //D to do 
-       trans_mode = VSOCK;
+       mTransMode = VSOCK;
        ALOGV("%s: falling back to UNIX as the trans mode is not set",__FUNCTION__);
     }
-    if(trans_mode == UNIX)
+    if(mTransMode == UNIX)
     {
-        threadParam->mSocketServerFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
-        if (threadParam->mSocketServerFd < 0) {
+        mSocketServerFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (mSocketServerFd < 0) {
             ALOGV("%s:%d Fail to construct camera socket with error: %s", __FUNCTION__, __LINE__,
               strerror(errno));
-            return NULL;
+            return false;
         }
 
-    struct sockaddr_un addr_un;
-    memset(&addr_un, 0, sizeof(addr_un));
-    addr_un.sun_family = AF_UNIX;
-
-    if(strlen(threadParam->mSocketPath.c_str()) <= UNIX_PATH_MAX)
-        strncpy(&addr_un.sun_path[0], threadParam->mSocketPath.c_str(), strlen(threadParam->mSocketPath.c_str()));
-    else
-        ALOGE("%s: Invalid mSocketPath of size %zu",__FUNCTION__,strlen(threadParam->mSocketPath.c_str()));
-    int ret = 0;
+        struct sockaddr_un addr_un;
+        memset(&addr_un, 0, sizeof(addr_un));
+        addr_un.sun_family = AF_UNIX;
 
-    try{
-        ret = unlink(threadParam->mSocketPath.c_str());
-    }catch(const std::exception &e)
-    {
-        ALOGE("%s The unlink errno is %s",__FUNCTION__,strerror(errno));
-    }
+        if(strlen(mSocketPath.c_str()) <= UNIX_PATH_MAX)
+            strncpy(&addr_un.sun_path[0], mSocketPath.c_str(), strlen(mSocketPath.c_str()));
+        else
+            ALOGE("%s: Invalid mSocketPath of size %zu",__FUNCTION__,strlen(mSocketPath.c_str()));
 
-    if (ret<0 &&( (errno != ENOENT) || errno !=EPERM || errno != ENOTDIR) ) {
-        ALOGE(LOG_TAG " %s Failed to unlink %s address %d, %s", __FUNCTION__,
-            threadParam->mSocketPath.c_str(), ret, strerror(errno));
-            return NULL;
-    }
+        int ret = unlink(mSocketPath.c_str());
+        if (ret < 0 && errno != ENOENT) {
+            ALOGE(LOG_TAG " %s Failed to unlink %s address %d, %s", __FUNCTION__,
+                mSocketPath.c_str(), ret, strerror(errno));
+            return false;
+        }
 
-    ALOGV(LOG_TAG " %s camera socket server file %s will created. ", __FUNCTION__,
-        threadParam->mSocketPath.c_str());
+        ALOGV(LOG_TAG " %s camera socket server file %s will created. ", __FUNCTION__,
+            mSocketPath.c_str());
 
-    ret = ::bind(threadParam->mSocketServerFd, (struct sockaddr *)&addr_un,
-                 sizeof(sa_family_t) + strlen(threadParam->mSocketPath.c_str()) + 1);
-    if (ret < 0) {
-        ALOGE(LOG_TAG " %s Failed to bind %s address %d, %s", __FUNCTION__, threadParam->mSocketPath.c_str(),
-              ret, strerror(errno));
-        return NULL;
-    }
+        ret = ::bind(mSocketServerFd, (struct sockaddr *)&addr_un,
+                     sizeof(sa_family_t) + strlen(mSocketPath.c_str()) + 1);
+        if (ret < 0) {
+            ALOGE(LOG_TAG " %s Failed to bind %s address %d, %s", __FUNCTION__, mSocketPath.c_str(),
+                  ret, strerror(errno));
+            return false;
+        }
 
-    struct stat st;
-    __mode_t mod = S_IRWXU | S_IRWXG | S_IRWXO;
-    if (fstat(threadParam->mSocketServerFd, &st) == 0) {
-        mod |= st.st_mode;
-    }
-    if(chmod(threadParam->mSocketPath.c_str(), mod) < 0) {
-        ALOGE("%s fail to chmod",__FUNCTION__);
-        return NULL;
-    }
-    if(stat(threadParam->mSocketPath.c_str(), &st) < 0) {
-        ALOGE("%s fail to statd",__FUNCTION__);
-        return NULL;
-    }
-        ret = listen(threadParam->mSocketServerFd, 5);
+        struct stat st;
+        __mode_t mod = S_IRWXU | S_IRWXG | S_IRWXO;
+        if (fstat(mSocketServerFd, &st) == 0) {
+            mod |= st.st_mode;
+        }
+        if(chmod(mSocketPath.c_str(), mod) < 0) {
+            ALOGE("%s fail to chmod",__FUNCTION__);
+            return false;
+        }
+        if(stat(mSocketPath.c_str(), &st) < 0) {
+            ALOGE("%s fail to statd",__FUNCTION__);
+            return false;
+        }
+        ret = listen(mSocketServerFd, 5);
         if (ret < 0) {
-            ALOGE("%s Failed to listen on %s", __FUNCTION__, threadParam->mSocketPath.c_str());
-            return NULL;
+            ALOGE("%s Failed to listen on %s", __FUNCTION__, mSocketPath.c_str());
+            return false;
         }
     }
-    else if(trans_mode == TCP){
+    else if(mTransMode == TCP){
         int ret = 0;
-        int new_client_fd =-1;
         int port = 8085;
         int so_reuseaddr = 1;
-        threadParam->mSocketServerFd = ::socket(AF_INET, SOCK_STREAM, 0);
-        if (threadParam->mSocketServerFd < 0) {
+        mSocketServerFd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (mSocketServerFd < 0) {
             ALOGV(LOG_TAG " %s:Line:[%d] Fail to construct camera socket with error: [%s]",
             __FUNCTION__, __LINE__, strerror(errno));
-            return NULL;
+            return false;
         }
-        if (setsockopt(threadParam->mSocketServerFd, SOL_SOCKET, SO_REUSEADDR, &so_reuseaddr,
+        if (setsockopt(mSocketServerFd, SOL_SOCKET, SO_REUSEADDR, &so_reuseaddr,
                    sizeof(int)) < 0) {
              ALOGV(LOG_TAG " %s setsockopt(SO_REUSEADDR) failed. : %d\n", __func__,
-            threadParam->mSocketServerFd);
-            return NULL;
+            mSocketServerFd);
+            return false;
         }
+        memset(&addr_ip, 0, sizeof(addr_ip));
         addr_ip.sin_family = AF_INET;
         addr_ip.sin_addr.s_addr = htonl(INADDR_ANY);
         addr_ip.sin_port = htons(port);
 
-        ret = ::bind(threadParam->mSocketServerFd, (struct sockaddr *)&addr_ip,
+        ret = ::bind(mSocketServerFd, (struct sockaddr *)&addr_ip,
                sizeof(struct sockaddr_in));
         if (ret < 0) {
             ALOGV(LOG_TAG " %s Failed to bind port(%d). ret: %d, %s", __func__, port, ret,
             strerror(errno));
-            return NULL;
+            return false;
         }
-        ret = listen(threadParam->mSocketServerFd, 5);
+        ret = listen(mSocketServerFd, 5);
         if (ret < 0) {
             ALOGV("%s Failed to listen on ", __FUNCTION__);
-            return NULL;
+            return false;
         }
     }else{
-        memset(&addr_ip, 0, sizeof(addr_ip));
+        memset(&addr_vm, 0, sizeof(addr_vm));
         addr_vm.svm_family = AF_VSOCK;
         addr_vm.svm_port = 1982;
         addr_vm.svm_cid = 3;
         int ret = 0;
-        int so_reuseaddr = 1;
-        threadParam->size_update = 0;
-        threadParam->mSocketServerFd = ::socket(AF_VSOCK, SOCK_STREAM, 0);
-        if (threadParam->mSocketServerFd < 0) {
-        ALOGV(LOG_TAG " %s:Line:[%d] Fail to construct camera socket with error: [%s]",
-        __FUNCTION__, __LINE__, strerror(errno));
-        return NULL;
+        mSocketServerFd = ::socket(AF_VSOCK, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (mSocketServerFd < 0) {
+            ALOGV(LOG_TAG " %s:Line:[%d] Fail to construct camera socket with error: [%s]",
+            __FUNCTION__, __LINE__, strerror(errno));
+            return false;
         }
-        ret = ::bind(threadParam->mSocketServerFd, (struct sockaddr *)&addr_vm,
+        ret = ::bind(mSocketServerFd, (struct sockaddr *)&addr_vm,
             sizeof(struct sockaddr_vm));
         if (ret < 0) {
             ALOGV(LOG_TAG " %s Failed to bind port(%d). ret: %d, %s", __func__, addr_vm.svm_port, ret,
             strerror(errno));
-            return NULL;
+            return false;
         }
-        ret = listen(threadParam->mSocketServerFd, 32);
+        ret = listen(mSocketServerFd, 32);
         if (ret < 0) {
-        ALOGV("%s Failed to listen on ", __FUNCTION__);
-        return NULL;
+            ALOGV("%s Failed to listen on ", __FUNCTION__);
+            return false;
         }
+    }
+    return true;
+}
 
+// epoll_event.data layout: low 32 bits identify the source, high 32 bits
+// carry the client generation for kEventSourceClient.
+enum EventSource : uint32_t {
+    kEventSourceControl = 0,
+    kEventSourceListener = 1,
+    kEventSourceClient = 2,
+    kEventSourceUring = 3,
+};
+
+static inline uint64_t makeEventData(EventSource source, uint32_t generation = 0) {
+    return (uint64_t(generation) << 32) | source;
+}
+
+static const int kMaxEpollEvents = 8;
+
+void* CameraSocketServerThread::threadFunc(void *arg) {
+    CameraSocketServerThread *threadParam = (CameraSocketServerThread *)arg;
+
+    if (!threadParam->setupServerSocket()) {
+        return NULL;
+    }
+    threadParam->serve();
+
+    ALOGE(" %s: Quit CameraSocketServerThread... %s(%d)", __FUNCTION__, threadParam->mSocketPath.c_str(),
+          threadParam->mClientFd);
+    threadParam->closeClient();
+    close(threadParam->mSocketServerFd);
+    threadParam->mSocketServerFd = -1;
+
+    return threadParam;
+}
+
+void CameraSocketServerThread::serve() {
+    struct epoll_event ev = {};
+    struct epoll_event events[kMaxEpollEvents];
+
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFd < 0) {
+        ALOGE(LOG_TAG " %s: epoll_create1 failed: %s", __FUNCTION__, strerror(errno));
+        return;
+    }
+
+    // Control eventfd is level triggered; it is drained on every wakeup.
+    ev.events = EPOLLIN;
+    ev.data.u64 = makeEventData(kEventSourceControl);
+    if (mControlFd < 0 || epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mControlFd, &ev) < 0) {
+        ALOGE(LOG_TAG " %s: Failed to watch control eventfd: %s", __FUNCTION__, strerror(errno));
+        return;
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = makeEventData(kEventSourceListener);
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mSocketServerFd, &ev) < 0) {
+        ALOGE(LOG_TAG " %s: Failed to watch server socket: %s", __FUNCTION__, strerror(errno));
+        return;
     }
-    while (threadParam->mRunning) {
-        ALOGI(LOG_TAG " %s: Wait for camera client to connect. . .", __FUNCTION__);
 
-        if (trans_mode == TCP) {
-            socklen_t alen = sizeof(struct sockaddr_in);
-            new_client_fd = ::accept(threadParam->mSocketServerFd, (struct sockaddr *)&addr_ip, &alen);
+#ifdef ENABLE_IO_URING
+    mUring.reset(new IoUringReceiver());
+    ev.events = EPOLLIN;
+    ev.data.u64 = makeEventData(kEventSourceUring);
+    if (!mUring->init() || epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mUring->eventFd(), &ev) < 0) {
+        ALOGI(LOG_TAG " %s: io_uring receive unavailable, using recv()", __FUNCTION__);
+        mUring.reset();
+    }
+#endif
+
+    ALOGI(LOG_TAG " %s: Wait for camera client to connect. . .", __FUNCTION__);
+    while (mRunning) {
+        int count = epoll_wait(mEpollFd, events, kMaxEpollEvents, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            ALOGE(LOG_TAG " %s: epoll_wait failed: %s", __FUNCTION__, strerror(errno));
+            break;
         }
-        else if(trans_mode == VSOCK){
-            socklen_t alen = sizeof(struct sockaddr_vm);
-            new_client_fd = ::accept(threadParam->mSocketServerFd, (struct sockaddr *)&addr_vm, &alen);
+
+        for (int i = 0; i < count && mRunning; i++) {
+            uint64_t data = events[i].data.u64;
+            switch (EventSource(data & 0xffffffff)) {
+                case kEventSourceControl:
+                    handleControlEvents();
+                    break;
+                case kEventSourceListener:
+                    acceptClients();
+                    break;
+                case kEventSourceClient:
+                    if (mClientFd >= 0 && uint32_t(data >> 32) == mClientGeneration) {
+                        handleClientEvents(events[i].events);
+                    }
+                    break;
+#ifdef ENABLE_IO_URING
+                case kEventSourceUring:
+                    handleUringEvents();
+                    break;
+#endif
+                default:
+                    break;
+            }
         }
-        else
-        {
-            socklen_t alen = sizeof(struct sockaddr_un);
-            new_client_fd = ::accept(threadParam->mSocketServerFd, (struct sockaddr *)&addr_un, &alen);
+    }
+}
+
+void CameraSocketServerThread::handleControlEvents() {
+    uint64_t count;
+    while (read(mControlFd, &count, sizeof(count)) > 0) {
+    }
+
+    uint32_t pending = mPendingControl.exchange(0);
+    if (pending & kControlExit) {
+        ALOGI(LOG_TAG " %s: Exit requested", __FUNCTION__);
+        mRunning = false;
+    }
+    if (pending & kControlRequestKeyframe) {
+        sendKeyframeRequest();
+    }
+}
+
+void CameraSocketServerThread::acceptClients() {
+    while (mRunning) {
+        // Accepted sockets start blocking: capability negotiation below is a
+        // synchronous request/response exchange, bounded by
+        // kNegotiationTimeoutMs per receive.
+        int new_client_fd = accept4(mSocketServerFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (new_client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ALOGE(LOG_TAG " %s: Fail to accept client. Error: [%s]", __FUNCTION__,
+                      strerror(errno));
+            }
+            return;
         }
         ALOGI(LOG_TAG " %s: Accepted client: [%d]", __FUNCTION__, new_client_fd);
-        if (new_client_fd < 0) {
-            ALOGE(LOG_TAG " %s: Fail to accept client. Error: [%s]", __FUNCTION__, strerror(errno));
-            continue;
+
+        if (mClientFd >= 0) {
+            // A reconnecting client supersedes the old connection, which may
+            // not have been torn down cleanly by the peer.
+            ALOGI(LOG_TAG " %s: Replacing camera client [%d]", __FUNCTION__, mClientFd);
+            closeClient();
         }
-        threadParam->mClientFd = new_client_fd;
+        setClientFd(new_client_fd);
+        mClientGeneration++;
 
-        bool status = false;
-        status = threadParam->configureCapabilities(false);
-        if (status) {
-            ALOGI(LOG_TAG
-                  "%s: Capability negotiation and metadata update"
-                  "for %d camera(s) completed successfully..",
-                  __FUNCTION__, threadParam->mNumOfCamerasRequested);
+        if (!setClientBlocking(true) || !configureCapabilities(false)) {
+            // Not streamed from without a negotiated format.
+            ALOGE(LOG_TAG " %s: Capability negotiation failed, closing client", __FUNCTION__);
+            closeClient();
+            continue;
         }
+        ALOGI(LOG_TAG
+              "%s: Capability negotiation and metadata update"
+              "for %d camera(s) completed successfully..",
+              __FUNCTION__, mNumOfCamerasRequested);
 
-        ClientVideoBuffer *handle = ClientVideoBuffer::getClientInstance();
-        uint8_t *fbuffer = (uint8_t *)handle->clientBuf[handle->clientRevCount % 1].buffer;
         // Reset and clear the input buffer before receiving the frames.
-        handle->reset();
+        ClientVideoBuffer::getClientInstance()->reset();
+        startPacket();
+
+        if (!setClientBlocking(false)) {
+            ALOGE(LOG_TAG " %s: Failed to make client socket non-blocking", __FUNCTION__);
+            closeClient();
+            continue;
+        }
+#ifdef ENABLE_IO_URING
+        // Encoded streams are many small packets, where batching receives pays
+        // off. Raw frames are received in place by recv() instead of being
+        // copied out of the ring buffers, and capability re-negotiation, only
+        // done for raw input, needs the socket to itself.
+        if (mUring != nullptr && isInFrameEncoded() && mUring->start(mClientFd)) {
+            mUringClient = true;
+            continue;
+        }
+#endif
+        if (!watchClient()) {
+            closeClient();
+        }
+    }
+}
 
-        struct pollfd fd;
-        int event;
+bool CameraSocketServerThread::watchClient() {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = makeEventData(kEventSourceClient, mClientGeneration);
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mClientFd, &ev) < 0) {
+        ALOGE(LOG_TAG " %s: Failed to watch client socket: %s", __FUNCTION__, strerror(errno));
+        return false;
+    }
+    return true;
+}
 
-        fd.fd = threadParam->mClientFd;  // your socket handler
-        fd.events = POLLIN | POLLHUP;
+#ifdef ENABLE_IO_URING
+void CameraSocketServerThread::handleUringEvents() {
+    bool keep = mUring->processCompletions([this](const uint8_t *data, size_t size) {
+        return consumeClientData(data, size);
+    });
+    if (keep || !mUringClient) return;
+
+    mUringClient = false;
+    if (!mUring->usable()) {
+        // Multishot receive was rejected before any data arrived; continue
+        // this connection with recv(). Data already queued raises EPOLLIN
+        // right away on registration.
+        mUring->stop();
+        if (watchClient()) return;
+    }
+    closeClient();
+}
+#endif
 
-        while (true) {
-            // check if there are any events on fd.
-            int ret = poll(&fd, 1, 3000);  // 3 seconds for timeout
+void CameraSocketServerThread::handleClientEvents(uint32_t events) {
+    // Drain pending data first: the peer may send its last frame and close.
+    if ((events & EPOLLIN) && !readClient()) {
+        closeClient();
+        return;
+    }
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // connnection disconnected => socket is closed at the other end => close the
+        // socket.
+        ALOGE(LOG_TAG " %s: POLLHUP: Close camera socket connection", __FUNCTION__);
+        closeClient();
+    }
+}
 
-            event = fd.revents;  // returned events
+void CameraSocketServerThread::closeClient() {
+    int fd = getClientFd();
+    if (fd < 0) return;
 
-            if (event & POLLHUP) {
-                // connnection disconnected => socket is closed at the other end => close the
-                // socket.
-                ALOGE(LOG_TAG " %s: POLLHUP: Close camera socket connection", __FUNCTION__);
-                shutdown(threadParam->mClientFd, SHUT_RDWR);
-                close(threadParam->mClientFd);
-                threadParam->mClientFd = -1;
-                handle->reset();
-                break;
-            } else if (event & POLLIN) {  // preview / record
-                // data is available in socket => read data
-                if (gIsInFrameI420) {
-                    if(trans_mode == VSOCK){
-                        ssize_t size_header =0;
-                        size_t size_pending =0;
-                        //Check if the header type is data
-                        camera_header_t buffer_header = {};
-                        size_header = recv(threadParam->mClientFd, (char *)&buffer_header, sizeof(camera_header_t), 0);
-                        if(buffer_header.type == CAMERA_DATA){
-                            size_pending = (size_t)buffer_header.size;
-
-                            if(size_pending > SIZE_FRAME_MAX) {
-                                ALOGE("Invalid frame size %zu\n",size_pending);
-                                continue;
-                            }
-                            while(size_pending > 0){
-                                ssize_t size_data = 0;
-                                size_data = recv(threadParam->mClientFd, (char *)fbuffer+threadParam->size_update, size_pending, 0);
-                                if(size_data < 0){
-                                    //error handling while in preview
-                                   ALOGE(LOG_TAG "entered into recv error, break to recover");
-                                   continue;
-                                }
-                                threadParam->size_update += size_data;
-                                size_pending -= size_data;
-                                if (size_pending <= 0){
-                                    handle->clientRevCount++;
-#if 0
-                                FILE *fp_dump = fopen("/data/dump.yuv","w");
-                                if(fp_dump != NULL){
-                                fwrite(fbuffer,460800,1,fp_dump); 
-                                fclose(fp_dump);
-                                }
+#ifdef ENABLE_IO_URING
+    if (mUringClient) {
+        mUring->stop();
+        mUringClient = false;
+    }
 #endif
-                                    threadParam->size_update = 0;
-                                    ALOGV(LOG_TAG "[I420] %s: Packet rev %d and size %zd",
-                                       __FUNCTION__, handle->clientRevCount, size_data);
-                                    break;
-                                }
-                            }
-                        } else if(buffer_header.type == REQUEST_CAPABILITY){
-                            ALOGE("Calling request Capability \n");
-                            if(!threadParam->configureCapabilities(true)) {
-                                return NULL;
-                            }
-                        } else
-                            ALOGE("received NOT OK");
-                        }else{
-                            ssize_t size = 0;
-
-                            if ((size = recv(threadParam->mClientFd, (char *)fbuffer, 460800, MSG_WAITALL)) > 0) {
-                                handle->clientRevCount++;
-                                ALOGVV(LOG_TAG "[I420] %s: Pocket rev %d and size %zd",
-                                    __FUNCTION__, handle->clientRevCount, size);
-                            }
-                        }
-                    } else if (gIsInFrameMJPG) {
-
-                    ssize_t size_header =0;
-                    size_t size_pending =0;
-                    ALOGI("it is MJPG irecv the header");
-                    camera_header_t buffer_header = {};
-                    size_header = recv(threadParam->mClientFd, (char *)&buffer_header, sizeof(camera_header_t), 0);
-                    if (buffer_header.type == CAMERA_DATA) {
-                         size_pending = buffer_header.size;
-                         if(size_pending >  SIZE_FRAME_MAX) {
-                             ALOGE("Invalid frame size %zu\n",size_pending);
-                             continue;
-                         }
-                         uint8_t *mjpeg_buffer = (uint8_t *)malloc(size_pending);
-                         if (mjpeg_buffer == NULL) {
-                             ALOGE(LOG_TAG "%s: buffer allocation failed: %d ", __FUNCTION__, __LINE__);
-                             continue;
-                         }
-                         size_pending = buffer_header.size;
-                         ALOGE("it is MJPG recv buffer size %zd", size_pending);
-                         while (size_pending != 0) {
-                             ssize_t size_data = 0;
-                             ALOGI("it is MJPG recv buffer %zd", size_pending);
-                             size_data = recv(threadParam->mClientFd, (char *)mjpeg_buffer+threadParam->size_update, size_pending, 0);
-                             if (size_data < 0) {
-                                 //error handling while in preview
-                                 ALOGE(LOG_TAG "entered into recv error, break to recover");
-                                 continue;
-                              }
-                              threadParam->size_update += size_data;
-                              size_pending -= size_data;
-                              if (size_pending == 0) {
-                                  handle->clientRevCount++;
-                                  threadParam->size_update = 0;
-                                 
-                                  ALOGV(LOG_TAG
-                                      "[MJPEG] %s: Packet rev %d and "
-                                      "size %zd",
-                                      __FUNCTION__, handle->clientRevCount, size_data);
-                                  break;
-                              }
-                          }
-                          int res = libyuv::MJPGToI420(
-                          mjpeg_buffer, buffer_header.size, static_cast<uint8_t*>(fbuffer), gCameraMaxWidth,
-                          static_cast<uint8_t*>(fbuffer + (gCameraMaxWidth * gCameraMaxHeight)), (gCameraMaxWidth / 2),
-                          static_cast<uint8_t*>(fbuffer + (gCameraMaxWidth * gCameraMaxHeight) + ((gCameraMaxWidth * gCameraMaxHeight) / 4)), (gCameraMaxWidth / 2),
-                          gCameraMaxWidth, gCameraMaxHeight, gCameraMaxWidth, gCameraMaxHeight);
-                          if (res != 0) {
-                              ALOGE("updated fail to convert MJPG to I420 ret %d  and sz %d", res, buffer_header.size);
-                          }
-                          free(mjpeg_buffer);
-                    } else if(buffer_header.type == REQUEST_CAPABILITY){
-                        ALOGE("Calling request Capability \n");
-                        if(!threadParam->configureCapabilities(true)) {
-                            return NULL;
-                        }
-                    } else
-                        ALOGE("MJPEG received NOT OK");
-                } else if (gIsInFrameH264) {  // default H264
+    if (mEpollFd >= 0) {
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+    setClientFd(-1);
+    mReader = PacketReader();
+    mProtocolVersion = CAMERA_PROTOCOL_VERSION_LEGACY;
+    mShmTransport = false;
+    mShmRing = nullptr;
+    if (mShmFd >= 0) {
+        close(mShmFd);
+        mShmFd = -1;
+    }
+    ClientVideoBuffer::getClientInstance()->reset();
+}
+
+bool CameraSocketServerThread::setClientBlocking(bool blocking) {
+    int flags = fcntl(mClientFd, F_GETFL, 0);
+    if (flags < 0) return false;
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    if (fcntl(mClientFd, F_SETFL, flags) != 0) return false;
+    if (!blocking) return true;
+
+    // Blocking exchanges run on the reactor thread, so a client that stalls
+    // must not hold it up.
+    struct timeval timeout = {};
+    timeout.tv_sec = kNegotiationTimeoutMs / 1000;
+    timeout.tv_usec = (kNegotiationTimeoutMs % 1000) * 1000;
+    if (setsockopt(mClientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(mClientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        ALOGE(LOG_TAG " %s: Failed to set socket timeouts: %s", __FUNCTION__, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+ssize_t CameraSocketServerThread::receive(struct iovec *iov, size_t iovcnt) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    if (mShmTransport) {
+        // CAMERA_SHM_CONFIG carries the memfd as ancillary data.
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+    }
+
+    ssize_t size = recvmsg(mClientFd, &msg, MSG_CMSG_CLOEXEC);
+    if (size <= 0 || !mShmTransport) return size;
+
+    if (msg.msg_flags & MSG_CTRUNC) {
+        ALOGE(LOG_TAG "%s: Ancillary data truncated", __FUNCTION__);
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            if (mShmFd >= 0) close(mShmFd);
+            memcpy(&mShmFd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return size;
+}
+
+void CameraSocketServerThread::startPacket() {
+    mReader.received = 0;
+    mReader.buffer = nullptr;
+    mReader.payload = nullptr;
+    if (gIsInFrameI420 && mTransMode != VSOCK && !mShmTransport &&
+        mProtocolVersion == CAMERA_PROTOCOL_VERSION_LEGACY) {
+        // Legacy TCP/UNIX I420 clients stream bare frames without a header.
+        mReader.state = PacketReader::State::kRawFrame;
+        mReader.expected = kLegacyRawFrameSize;
+        mReader.buffer = ClientVideoBuffer::getClientInstance()->acquireBuffer(
+            ClientVideoBuffer::maxFrameSize());
+        if (mReader.buffer != nullptr) {
+            mReader.payload = mReader.buffer->data();
+        } else {
+            ALOGW(LOG_TAG "%s: No free ingest buffer, dropping frame", __FUNCTION__);
+        }
+    } else {
+        mReader.state = PacketReader::State::kHeader;
+        mReader.expected = sizeof(camera_header_t);
+    }
+}
+
+uint8_t *CameraSocketServerThread::readerWindow(size_t *len) {
+    *len = mReader.expected - mReader.received;
+    if (mReader.state == PacketReader::State::kHeader) {
+        return reinterpret_cast<uint8_t *>(&mReader.header) + mReader.received;
+    } else if (mReader.state == PacketReader::State::kDataHeader) {
+        return reinterpret_cast<uint8_t *>(&mReader.dataHeader) + mReader.received;
+    }
+    return (mReader.payload != nullptr) ? mReader.payload + mReader.received : nullptr;
+}
+
+bool CameraSocketServerThread::commitRead(size_t size) {
+    mReader.received += size;
+    // Loops for packets with an empty payload, which complete with their header.
+    while (mReader.received == mReader.expected) {
+        if (mReader.state == PacketReader::State::kHeader) {
+            ALOGVV("%s: Received Header %zu bytes. Payload size: %u", __FUNCTION__,
+                   mReader.received, mReader.header.size);
+            if (!onHeaderReceived()) return false;
+        } else if (mReader.state == PacketReader::State::kDataHeader) {
+            onDataHeaderReceived();
+        } else {
+            onPacketReceived();
+            startPacket();
+        }
+    }
+    return true;
+}
+
+bool CameraSocketServerThread::readClient() {
+    // Sink for payloads that are skipped to keep the framing in sync.
+    uint8_t discard[4096];
+    // Header of the next packet, read along with the end of the current payload.
+    camera_header_t next;
+
+    while (true) {
+        struct iovec iov[2];
+        size_t iovcnt = 1;
+        size_t len;
+        uint8_t *dst = readerWindow(&len);
+        if (dst == nullptr) {
+            dst = discard;
+            len = std::min(len, sizeof(discard));
+        }
+        iov[0].iov_base = dst;
+        iov[0].iov_len = len;
+        if (mReader.state == PacketReader::State::kPayload &&
+            mReader.received + len == mReader.expected) {
+            iov[1].iov_base = &next;
+            iov[1].iov_len = sizeof(next);
+            iovcnt = 2;
+        }
+
+        ssize_t size = receive(iov, iovcnt);
+        if (size == 0) {
+            ALOGI(LOG_TAG " %s: Camera client closed the connection", __FUNCTION__);
+            return false;
+        } else if (size < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            ALOGE(LOG_TAG " %s: recv failed: %s", __FUNCTION__, strerror(errno));
+            return false;
+        }
+
+        size_t extra = (size_t(size) > len) ? size - len : 0;
+        if (!commitRead(size - extra)) return false;
+        if (extra > 0 && !consumeClientData(reinterpret_cast<uint8_t *>(&next), extra)) {
+            return false;
+        }
+    }
+}
+
+bool CameraSocketServerThread::consumeClientData(const uint8_t *data, size_t size) {
+    while (size > 0) {
+        size_t len;
+        uint8_t *dst = readerWindow(&len);
+        len = std::min(len, size);
+        if (dst != nullptr) {
+            memcpy(dst, data, len);
+        }
+        data += len;
+        size -= len;
+        if (!commitRead(len)) return false;
+    }
+    return true;
+}
+
+bool CameraSocketServerThread::onHeaderReceived() {
+    const camera_header_t &header = mReader.header;
+
+    if (header.type == REQUEST_CAPABILITY) {
+        if (isInFrameEncoded()) {
+            ALOGI(LOG_TAG
+                  "%s: [Warning] Capability negotiation was already "
+                  "done for %d camera(s); Can't do re-negotiation again!!!",
+                  __FUNCTION__, mNumOfCamerasRequested);
+            startPacket();
+            return true;
+        }
+        ALOGE("Calling request Capability \n");
+        // Negotiation is a blocking exchange; resume non-blocking framing after it.
+        bool status = setClientBlocking(true) && configureCapabilities(true);
+        if (!setClientBlocking(false) || !status) {
+            return false;
+        }
+        startPacket();
+        return true;
+    }
+
+    if (header.type == CAMERA_DATA && mProtocolVersion == CAMERA_PROTOCOL_VERSION_3) {
+        if (header.size >= sizeof(camera_data_header_t)) {
+            mReader.state = PacketReader::State::kDataHeader;
+            mReader.expected = sizeof(camera_data_header_t);
+            mReader.received = 0;
+            return true;
+        }
+        ALOGE(LOG_TAG "%s: CAMERA_DATA packet of %u bytes has no data header", __FUNCTION__,
+              header.size);
+        startPayload(header.size, false);
+        return true;
+    }
+
+    startPayload(header.size, true);
+    return true;
+}
+
+void CameraSocketServerThread::onDataHeaderReceived() {
+    const camera_data_header_t &data = mReader.dataHeader;
+    uint32_t size = mReader.header.size - sizeof(camera_data_header_t);
+    bool keep = true;
+
+    if (data.size != sizeof(camera_data_header_t)) {
+        // A newer client may extend the header; only the known part is used.
+        ALOGE(LOG_TAG "%s: Unsupported data header size %u", __FUNCTION__, data.size);
+        keep = false;
+    } else if (mLastSequence != 0 && data.sequence <= mLastSequence) {
+        ALOGW(LOG_TAG "%s: Dropping stale frame #%" PRIu64 ", last was #%" PRIu64, __FUNCTION__,
+              data.sequence, mLastSequence);
+        mFramesStale++;
+        keep = false;
+    } else {
+        if (mLastSequence != 0 && data.sequence > mLastSequence + 1) {
+            ALOGW(LOG_TAG "%s: Lost %" PRIu64 " frame(s) before #%" PRIu64, __FUNCTION__,
+                  data.sequence - mLastSequence - 1, data.sequence);
+            mFramesLost += data.sequence - mLastSequence - 1;
+            onStreamDiscontinuity();
+        }
+        mLastSequence = data.sequence;
+        if (data.flags & CAMERA_DATA_FLAG_END_OF_STREAM) {
+            // A restarted stream numbers its frames from 1 again.
+            ALOGI(LOG_TAG "%s: End of stream after frame #%" PRIu64, __FUNCTION__,
+                  data.sequence);
+            mLastSequence = 0;
+        }
+    }
+    ALOGVV(LOG_TAG "%s: Frame #%" PRIu64 " flags 0x%x captured at %" PRId64, __FUNCTION__,
+           data.sequence, data.flags, data.timestamp_ns);
+    if (!keep) {
+        // A dropped access unit breaks the reference chain like a lost one.
+        onStreamDiscontinuity();
+    }
+
+    startPayload(size, keep);
+    if (mReader.buffer != nullptr) {
+        mReader.buffer->setFrameInfo(data.sequence, toLocalTime(data.timestamp_ns));
+    }
+}
+
+int64_t CameraSocketServerThread::toLocalTime(int64_t clientTimeNs) const {
+    if (mClockRttNs < 0 || clientTimeNs == 0) return 0;
+    return clientTimeNs - mClockOffsetNs;
+}
+
+void CameraSocketServerThread::startPayload(uint32_t size, bool keep) {
+    const camera_header_t &header = mReader.header;
+
+    mReader.state = PacketReader::State::kPayload;
+    mReader.expected = size;
+    mReader.received = 0;
+    mReader.buffer = nullptr;
+    mReader.payload = nullptr;
+    if (!keep) return;
+
+    if (header.type == CAMERA_CLOCK_SYNC) {
+        if (mProtocolVersion == CAMERA_PROTOCOL_VERSION_3 && size == sizeof(mClockSync)) {
+            mReader.payload = reinterpret_cast<uint8_t *>(&mClockSync);
+        } else {
+            ALOGE(LOG_TAG "%s: Unexpected CAMERA_CLOCK_SYNC packet of %u bytes", __FUNCTION__,
+                  size);
+        }
+        return;
+    }
+
+    if (header.type == CAMERA_SHM_CONFIG || (header.type == CAMERA_DATA && mShmTransport)) {
+        // Fixed size control payloads of the shared-memory transport.
+        bool config = header.type == CAMERA_SHM_CONFIG;
+        size_t expected = config ? sizeof(mShmConfig) : sizeof(mShmFrame);
+        if (mShmTransport && size == expected) {
+            mReader.payload = config ? reinterpret_cast<uint8_t *>(&mShmConfig)
+                                     : reinterpret_cast<uint8_t *>(&mShmFrame);
+        } else {
+            ALOGE(LOG_TAG "%s: Unexpected %s packet of %u bytes", __FUNCTION__,
+                  camera_type_to_str(header.type), size);
+        }
+        return;
+    }
+
+    if (header.type != CAMERA_DATA) {
+        ALOGE(LOG_TAG "%s: invalid camera_packet_type: %s", __FUNCTION__,
+              camera_type_to_str(header.type));
+    } else if (!gIsInFrameI420 && !gIsInFrameMJPG && !isInFrameEncoded()) {
+        ALOGE("%s: Only H264, H265, I420 Input frames are supported. Check Input format",
+              __FUNCTION__);
+    } else if (size > ClientVideoBuffer::maxFrameSize()) {
+        // Neither a raw frame nor any sane encoded frame exceeds a raw frame
+        // at the max supported resolution.
+        ALOGE("%s Fatal: Unusual packet size detected: %u! Max is %zu", __func__, size,
+              ClientVideoBuffer::maxFrameSize());
+    } else {
+        // Raw I420 slots are sized for a full frame: the sensor reads a whole
+        // frame at the source resolution from them.
+        size_t capacity = gIsInFrameI420 ? ClientVideoBuffer::maxFrameSize() : size;
+        mReader.buffer = ClientVideoBuffer::getClientInstance()->acquireBuffer(capacity);
+        if (mReader.buffer == nullptr) {
+            ALOGW(LOG_TAG "%s: No free ingest buffer, dropping packet", __FUNCTION__);
+            onStreamDiscontinuity();
+        }
+    }
+
+    // Packets without a destination are still read and dropped so that the
+    // next header is found at the right offset.
+    mReader.payload = (mReader.buffer != nullptr) ? mReader.buffer->data() : nullptr;
+}
+
+void CameraSocketServerThread::sendClockSync() {
+    camera_header_t header = {CAMERA_CLOCK_SYNC, sizeof(camera_clock_sync_t)};
+    camera_clock_sync_t probe = {};
+    probe.hal_send_ns = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    struct iovec iov[2] = {{&header, sizeof(header)}, {&probe, sizeof(probe)}};
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    // Best effort: a probe that does not fit the socket buffer is skipped.
+    if (sendmsg(mClientFd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) !=
+        ssize_t(sizeof(header) + sizeof(probe))) {
+        ALOGW(LOG_TAG "%s: Failed to send clock probe: %s", __FUNCTION__, strerror(errno));
+    }
+}
+
+void CameraSocketServerThread::sendKeyframeRequest() {
+    if (mClientFd < 0 || mProtocolVersion != CAMERA_PROTOCOL_VERSION_3 || !isInFrameEncoded()) {
+        return;
+    }
+
+    int64_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (mLastKeyframeRequestNs != 0 && now - mLastKeyframeRequestNs < mKeyframeRequestIntervalNs) {
+        mKeyframeRequestsLimited++;
+        return;
+    }
+
+    camera_header_t header = {CAMERA_REQUEST_KEYFRAME, 0};
+    if (send(mClientFd, &header, sizeof(header), MSG_DONTWAIT | MSG_NOSIGNAL) !=
+        ssize_t(sizeof(header))) {
+        ALOGW(LOG_TAG "%s: Failed to send keyframe request: %s", __FUNCTION__, strerror(errno));
+        return;
+    }
+    mLastKeyframeRequestNs = now;
+    mKeyframeRequests++;
+    ALOGI(LOG_TAG "%s: Requested keyframe from client", __FUNCTION__);
+}
+
+void CameraSocketServerThread::onStreamDiscontinuity() {
 #ifdef ENABLE_FFMPEG
-                    ssize_t size = 0;
-                    camera_header_t header = {};
-                    if ((size = recv(mClientFd, (char *)&header, sizeof(camera_header_t),
-                                     MSG_WAITALL)) > 0) {
-                        ALOGVV("%s: Received Header %zd bytes. Payload size: %u", __FUNCTION__,
-                               size, header.size);
-                        if (header.type == REQUEST_CAPABILITY) {
-                            ALOGI(LOG_TAG
-                                  "%s: [Warning] Capability negotiation was already "
-                                  "done for %d camera(s); Can't do re-negotiation again!!!",
-                                  __FUNCTION__, mNumOfCamerasRequested);
-                            continue;
-                        } else if (header.type != CAMERA_DATA) {
-                            ALOGE(LOG_TAG "%s: invalid camera_packet_type: %s", __FUNCTION__,
-                                  camera_type_to_str(header.type));
-                            continue;
-                        }
-
-                        if (header.size > mSocketBuffer.size()) {
-                            // maximum size of a H264 packet in any aggregation packet is 65535
-                            // bytes. Source: https://tools.ietf.org/html/rfc6184#page-13
-                            ALOGE(
-                                "%s Fatal: Unusual encoded packet size detected: %u! Max is %zu, "
-                                "...",
-                                __func__, header.size, mSocketBuffer.size());
-                            continue;
-                        }
-
-                        // recv frame
-                        if ((size = recv(mClientFd, (char *)mSocketBuffer.data(), header.size,
-                                         MSG_WAITALL)) > 0) {
-                            if (size < header.size) {
-                                ALOGW("%s : Incomplete data read %zd/%u bytes", __func__, size,
-                                      header.size);
-                                size_t remaining_size = header.size;
-                                remaining_size -= size;
-                                while (remaining_size > 0) {
-                                    if ((size = recv(mClientFd, (char *)mSocketBuffer.data() + size,
-                                                     remaining_size, MSG_WAITALL)) > 0) {
-                                        remaining_size -= size;
-                                        ALOGI("%s : Read-%zd after Incomplete data, remaining-%lu",
-                                              __func__, size, remaining_size);
-                                    }
-                                }
-                                size = header.size;
-                            }
-
-                            mSocketBufferSize = header.size;
-                            ALOGVV("%s: Camera session state: %s", __func__,
-                                   kCameraSessionStateNames.at(mCameraSessionState).c_str());
-                            switch (mCameraSessionState) {
-                                case CameraSessionState::kCameraOpened:
-                                    mCameraSessionState = CameraSessionState::kDecodingStarted;
-                                    ALOGVV("%s: Decoding started now.", __func__);
-                                case CameraSessionState::kDecodingStarted:
-                                    mVideoDecoder->decode(mSocketBuffer.data(), mSocketBufferSize);
-                                    handle->clientRevCount++;
-                                    ALOGVV("%s: Received Payload #%d %zd/%u bytes", __func__,
-                                           handle->clientRevCount, size, header.size);
-                                    mSocketBuffer.fill(0);
-                                    break;
-                                case CameraSessionState::kCameraClosed:
-                                    ALOGI("%s: Decoding stopping and flushing decoder.", __func__);
-                                    mCameraSessionState = CameraSessionState::kDecodingStopped;
-                                    ALOGI("%s: Decoding stopped now.", __func__);
-                                    break;
-                                case CameraSessionState::kDecodingStopped:
-                                    ALOGVV("%s: Decoding is already stopped, skip the packets",
-                                           __func__);
-                                    mSocketBuffer.fill(0);
-                                    break;
-                                default:
-                                    ALOGE("%s: Invalid Camera session state!", __func__);
-                                    break;
-                            }
-                        }
-                    }
+    if (!isInFrameEncoded()) return;
+    mVideoDecoder->conceal_until_keyframe();
+    sendKeyframeRequest();
 #endif
-                } else {
-                    ALOGE(
-                        "%s: Only H264, I420 Input frames are supported. Check Input format",
-                        __FUNCTION__);
-                }
-            } else {
-                //    ALOGE("%s: continue polling..", __FUNCTION__);
-            }
+}
+
+void CameraSocketServerThread::onClockSyncReceived() {
+    int64_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    int64_t rtt = now - mClockSync.hal_send_ns;
+    if (mClockSync.hal_send_ns == 0 || rtt < 0) {
+        ALOGE(LOG_TAG "%s: Invalid clock probe reply", __FUNCTION__);
+        return;
+    }
+
+    // The reply with the shortest round trip bounds the error best.
+    if (mClockRttNs < 0 || rtt < mClockRttNs) {
+        mClockOffsetNs = mClockSync.client_ns - (mClockSync.hal_send_ns + now) / 2;
+        mClockRttNs = rtt;
+        ALOGI(LOG_TAG "%s: Client clock offset %" PRId64 " ns, round trip %" PRId64 " ns",
+              __FUNCTION__, mClockOffsetNs.load(), rtt);
+    }
+    if (++mClockSyncSamples < kClockSyncSamples) {
+        sendClockSync();
+    }
+}
+
+void CameraSocketServerThread::onShmConfigReceived() {
+    if (mShmFd < 0) {
+        ALOGE(LOG_TAG "%s: CAMERA_SHM_CONFIG received without memfd", __FUNCTION__);
+        return;
+    }
+    // Slots must hold a whole I420 frame at the negotiated resolution.
+    mShmRing = SharedFrameRing::map(mShmFd, mShmConfig,
+                                    size_t(gCameraMaxWidth) * gCameraMaxHeight * 3 / 2);
+    mShmFd = -1;
+}
+
+void CameraSocketServerThread::onShmFrameReceived() {
+    ClientVideoBuffer *handle = ClientVideoBuffer::getClientInstance();
+
+    if (mShmRing == nullptr) {
+        ALOGE(LOG_TAG "%s: Frame announced before shared memory was configured", __FUNCTION__);
+        return;
+    }
+    IngestBufferRef frame = mShmRing->acquireSlot(mShmFrame.slot);
+    if (frame == nullptr) {
+        return;
+    }
+    frame->setFrameInfo(mShmFrame.sequence, toLocalTime(mShmFrame.timestamp_ns));
+    handle->publishFrame(frame);
+    handle->clientRevCount++;
+    ALOGVV(LOG_TAG "[SHM] %s: Frame rev %d seq %" PRIu64 " in slot %u", __FUNCTION__,
+           handle->clientRevCount, mShmFrame.sequence, mShmFrame.slot);
+}
+
+void CameraSocketServerThread::onPacketReceived() {
+    ClientVideoBuffer *handle = ClientVideoBuffer::getClientInstance();
+
+    if (mReader.header.type == CAMERA_CLOCK_SYNC) {
+        if (mReader.payload != nullptr) onClockSyncReceived();
+        return;
+    }
+
+    if (mReader.header.type == CAMERA_DATA &&
+        mProtocolVersion == CAMERA_PROTOCOL_VERSION_3 && mReader.payload != nullptr) {
+        int64_t captureTime = toLocalTime(mReader.dataHeader.timestamp_ns);
+        if (captureTime != 0) {
+            int64_t latency = systemTime(SYSTEM_TIME_MONOTONIC) - captureTime;
+            mLastLatencyNs = latency;
+            if (latency > mMaxLatencyNs) mMaxLatencyNs = latency;
         }
     }
-    ALOGE(" %s: Quit CameraSocketServerThread... %s(%d)", __FUNCTION__, threadParam->mSocketPath.c_str(),
-          threadParam->mClientFd);
-    shutdown(threadParam->mClientFd, SHUT_RDWR);
-    close(threadParam->mClientFd);
-    threadParam->mClientFd = -1;
-    close(threadParam->mSocketServerFd);
-    threadParam->mSocketServerFd = -1;
 
-    return threadParam;
+    if (mReader.header.type == CAMERA_SHM_CONFIG || mShmTransport) {
+        if (mReader.payload == nullptr) return;
+        if (mReader.header.type == CAMERA_SHM_CONFIG) {
+            onShmConfigReceived();
+        } else {
+            onShmFrameReceived();
+        }
+        return;
+    }
+
+    IngestBufferRef packet = std::move(mReader.buffer);
+
+    if (packet == nullptr) {
+        return;
+    }
+    packet->setSize(mReader.received);
+
+    if (gIsInFrameI420) {
+        handle->publishFrame(packet);
+        handle->clientRevCount++;
+        ALOGVV(LOG_TAG "[I420] %s: Packet rev %d and size %zu", __FUNCTION__,
+               handle->clientRevCount, packet->size());
+    } else if (gIsInFrameMJPG) {
+        IngestBufferRef frame = handle->acquireBuffer(ClientVideoBuffer::maxFrameSize());
+        if (frame == nullptr) {
+            ALOGW(LOG_TAG "%s: No free ingest buffer, dropping MJPEG frame", __FUNCTION__);
+            return;
+        }
+        uint8_t *fbuffer = frame->data();
+        handle->clientRevCount++;
+        ALOGV(LOG_TAG "[MJPEG] %s: Packet rev %d and size %zu", __FUNCTION__,
+              handle->clientRevCount, packet->size());
+        int res = libyuv::MJPGToI420(
+            packet->data(), packet->size(), static_cast<uint8_t*>(fbuffer), gCameraMaxWidth,
+            static_cast<uint8_t*>(fbuffer + (gCameraMaxWidth * gCameraMaxHeight)), (gCameraMaxWidth / 2),
+            static_cast<uint8_t*>(fbuffer + (gCameraMaxWidth * gCameraMaxHeight) + ((gCameraMaxWidth * gCameraMaxHeight) / 4)), (gCameraMaxWidth / 2),
+            gCameraMaxWidth, gCameraMaxHeight, gCameraMaxWidth, gCameraMaxHeight);
+        if (res != 0) {
+            ALOGE("updated fail to convert MJPG to I420 ret %d  and sz %zu", res, packet->size());
+            return;
+        }
+        frame->setSize(gCameraMaxWidth * gCameraMaxHeight * BPP_NV12);
+        frame->setFrameInfo(packet->sequence(), packet->captureTimeNs());
+        handle->publishFrame(frame);
+    } else if (isInFrameEncoded()) {
+#ifdef ENABLE_FFMPEG
+        ALOGVV("%s: Camera session state: %s", __func__,
+               kCameraSessionStateNames.at(mCameraSessionState).c_str());
+        switch (mCameraSessionState) {
+            case CameraSessionState::kCameraOpened:
+                mCameraSessionState = CameraSessionState::kDecodingStarted;
+                ALOGVV("%s: Decoding started now.", __func__);
+            case CameraSessionState::kDecodingStarted:
+                handle->clientRevCount++;
+                ALOGVV("%s: Received Payload #%d %zu bytes", __func__,
+                       handle->clientRevCount, packet->size());
+                if (!mDecoderThread->queuePacket(std::move(packet))) {
+                    onStreamDiscontinuity();
+                }
+                break;
+            case CameraSessionState::kCameraClosed:
+                ALOGI("%s: Decoding stopping and flushing decoder.", __func__);
+                mDecoderThread->flush();
+                mCameraSessionState = CameraSessionState::kDecodingStopped;
+                ALOGI("%s: Decoding stopped now.", __func__);
+                break;
+            case CameraSessionState::kDecodingStopped:
+                ALOGVV("%s: Decoding is already stopped, skip the packets",
+                       __func__);
+                break;
+            default:
+                ALOGE("%s: Invalid Camera session state!", __func__);
+                break;
+        }
+#endif
+    }
 }
 
 }  // namespace android
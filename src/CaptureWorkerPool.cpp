@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "CaptureWorkerPool"
+
+#include <log/log.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "CaptureWorkerPool.h"
+
+namespace android {
+
+CaptureWorkerPool::CaptureWorkerPool(size_t workers, const std::vector<int> &cpus) {
+    mThreads.reserve(workers);
+    for (size_t i = 0; i < workers; i++) {
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        mThreads.emplace_back(&CaptureWorkerPool::threadLoop, this, cpu);
+    }
+    if (cpus.empty()) {
+        ALOGI("%s: %zu workers, not pinned", __FUNCTION__, workers);
+    } else {
+        ALOGI("%s: %zu workers pinned over %zu CPUs", __FUNCTION__, workers, cpus.size());
+    }
+}
+
+std::vector<int> CaptureWorkerPool::parseCpuList(const char *list) {
+    std::vector<int> cpus;
+    const char *p = list;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) return {};
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return {};
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return {};
+        for (long cpu = first; cpu <= last; cpu++) cpus.push_back(int(cpu));
+        p = end;
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return {};
+        }
+    }
+    return cpus;
+}
+
+CaptureWorkerPool::~CaptureWorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mExit = true;
+    }
+    mWork.notify_all();
+    for (std::thread &thread : mThreads) {
+        thread.join();
+    }
+}
+
+void CaptureWorkerPool::runTask(Batch *batch, size_t index) {
+    (*batch->task)(index);
+
+    // Under the lock: run() returns, and the batch goes away, once all are done.
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (++batch->done == batch->count) {
+        mDone.notify_all();
+    }
+}
+
+void CaptureWorkerPool::run(size_t count, const std::function<void(size_t)> &task) {
+    if (count == 0) return;
+    if (count == 1 || mThreads.empty()) {
+        for (size_t i = 0; i < count; i++) task(i);
+        return;
+    }
+
+    Batch batch;
+    batch.task = &task;
+    batch.count = count;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mBatches.push_back(&batch);
+    }
+    if (count - 1 < mThreads.size()) {
+        for (size_t i = 0; i < count - 1; i++) mWork.notify_one();
+    } else {
+        mWork.notify_all();
+    }
+
+    for (size_t index; (index = batch.next.fetch_add(1)) < count;) {
+        runTask(&batch, index);
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto it = std::find(mBatches.begin(), mBatches.end(), &batch);
+    if (it != mBatches.end()) mBatches.erase(it);
+    mDone.wait(lock, [&batch] { return batch.done == batch.count; });
+}
+
+void CaptureWorkerPool::threadLoop(int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            ALOGW("%s: Failed to pin worker to CPU %d: %s", __FUNCTION__, cpu, strerror(errno));
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        mWork.wait(lock, [this] { return mExit || !mBatches.empty(); });
+        if (mExit) break;
+
+        Batch *batch = mBatches.front();
+        size_t index = batch->next.fetch_add(1);
+        if (index + 1 >= batch->count) {
+            // Nothing left to claim; the owner waits for the running ones.
+            mBatches.pop_front();
+        }
+        if (index >= batch->count) continue;
+
+        lock.unlock();
+        runTask(batch, index);
+        lock.lock();
+    }
+}
+
+}  // namespace android
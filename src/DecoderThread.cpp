@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+//#define LOG_NNDEBUG 0
+#define LOG_TAG "DecoderThread"
+
+#ifdef LOG_NNDEBUG
+#define ALOGVV(...) ALOGV(__VA_ARGS__)
+#else
+#define ALOGVV(...) ((void)0)
+#endif
+
+#ifdef ENABLE_FFMPEG
+
+#include <log/log.h>
+#include "DecoderThread.h"
+
+namespace android {
+
+// Drops the reference the decoder held on a zero-copy packet.
+static void releasePacket(void *opaque, uint8_t *data) {
+    delete static_cast<IngestBufferRef *>(opaque);
+}
+
+DecoderThread::DecoderThread(std::shared_ptr<CGVideoDecoder> decoder, size_t maxQueuedPackets,
+                             std::function<void()> requestKeyframe)
+    : mDecoder(decoder),
+      mRequestKeyframe(std::move(requestKeyframe)),
+      mQueue(maxQueuedPackets),
+      mThread(&DecoderThread::threadLoop, this) {}
+
+DecoderThread::~DecoderThread() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mExit = true;
+    }
+    mCond.notify_one();
+    mThread.join();
+}
+
+bool DecoderThread::queuePacket(IngestBufferRef packet) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mCount == mQueue.size()) {
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            ALOGW("%s: Decoder is %zu packets behind, dropping packet", __FUNCTION__, mCount);
+            return false;
+        }
+        mQueue[(mHead + mCount) % mQueue.size()] = std::move(packet);
+        mCount++;
+        mQueueDepth.store(mCount, std::memory_order_relaxed);
+        if (mCount > mMaxQueueDepth.load(std::memory_order_relaxed)) {
+            mMaxQueueDepth.store(mCount, std::memory_order_relaxed);
+        }
+    }
+    mCond.notify_one();
+    return true;
+}
+
+void DecoderThread::flush() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (; mCount > 0; mCount--) {
+        mQueue[mHead].reset();
+        mHead = (mHead + 1) % mQueue.size();
+    }
+    mQueueDepth.store(0, std::memory_order_relaxed);
+}
+
+void DecoderThread::threadLoop() {
+    while (true) {
+        IngestBufferRef packet;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCond.wait(lock, [this] { return mExit || mCount > 0; });
+            if (mExit) break;
+            packet = std::move(mQueue[mHead]);
+            mHead = (mHead + 1) % mQueue.size();
+            mCount--;
+            mQueueDepth.store(mCount, std::memory_order_relaxed);
+        }
+
+        // The ingest buffer carries the zeroed padding the decoder needs.
+        const uint8_t *data = packet->data();
+        int size = packet->size();
+        uint64_t sequence = packet->sequence();
+        int64_t captureTimeNs = packet->captureTimeNs();
+        int ret;
+        if (mAccessUnitAligned) {
+            // The decoder may keep the packet past this call, e.g. with frame
+            // threading, so it gets a reference of its own on the slot.
+            ret = mDecoder->decode_access_unit(data, size, releasePacket,
+                                               new IngestBufferRef(std::move(packet)), sequence,
+                                               captureTimeNs);
+        } else {
+            ret = mDecoder->decode(data, size, sequence, captureTimeNs);
+        }
+        if (ret < 0) {
+            mErrors.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (mDecoder->awaiting_keyframe() && mRequestKeyframe) {
+            mRequestKeyframe();
+        }
+        mDecoded.fetch_add(1, std::memory_order_relaxed);
+        ALOGVV("%s: Decoded %d bytes, %zu packets queued", __FUNCTION__, size, queueDepth());
+    }
+    ALOGV("%s: Decoder thread exiting", __FUNCTION__);
+}
+
+}  // namespace android
+
+#endif  // ENABLE_FFMPEG
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FrameHandle.h"
+#include <string.h>
+
+namespace android {
+
+static void copyPlane(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride,
+                      int widthBytes, int height) {
+    if (height <= 0) return;
+    if (srcStride == dstStride) {
+        // The padding of the last line may be past the end of either buffer.
+        memcpy(dst, src, size_t(srcStride) * (height - 1) + widthBytes);
+        return;
+    }
+    for (int i = 0; i < height; i++) {
+        memcpy(dst + size_t(dstStride) * i, src + size_t(srcStride) * i, widthBytes);
+    }
+}
+
+FrameHandle::FrameHandle(IngestBufferRef buffer, int width, int height, Layout layout) {
+    size_t lumaSize = size_t(width) * height;
+    if (buffer == nullptr || width <= 0 || height <= 0 ||
+        buffer->capacity() < lumaSize + lumaSize / 2) {
+        return;
+    }
+
+    uint8_t *data = buffer->data();
+    mData[0] = data;
+    mStride[0] = width;
+    if (layout == Layout::kI420) {
+        mData[1] = data + lumaSize;
+        mData[2] = data + lumaSize + lumaSize / 4;
+        mStride[1] = mStride[2] = width / 2;
+    } else {
+        mData[1] = data + lumaSize;
+        mStride[1] = width;
+    }
+    mWidth = width;
+    mHeight = height;
+    mLayout = layout;
+    mSequence = buffer->sequence();
+    mCaptureTimeNs = buffer->captureTimeNs();
+    mOwner = std::move(buffer);
+}
+
+bool FrameHandle::copyToNV12(uint8_t *dstY, int dstStrideY, uint8_t *dstUV,
+                             int dstStrideUV) const {
+    if (mOwner == nullptr || mLayout != Layout::kNV12) return false;
+
+    copyPlane(mData[0], mStride[0], dstY, dstStrideY, mWidth, mHeight);
+    copyPlane(mData[1], mStride[1], dstUV, dstStrideUV, (mWidth + 1) & ~1, (mHeight + 1) / 2);
+    return true;
+}
+
+#ifdef ENABLE_FFMPEG
+FrameHandle::FrameHandle(CGVideoFrame::Ptr frame) {
+    if (frame == nullptr) return;
+
+    const AVFrame *avframe = frame->av_frame();
+    size_t planes;
+    if (avframe->format == AV_PIX_FMT_YUV420P) {
+        mLayout = Layout::kI420;
+        planes = 3;
+    } else if (avframe->format == AV_PIX_FMT_NV12) {
+        mLayout = Layout::kNV12;
+        planes = 2;
+    } else {
+        return;
+    }
+
+    for (size_t i = 0; i < planes; i++) {
+        mData[i] = avframe->data[i];
+        mStride[i] = avframe->linesize[i];
+    }
+    mWidth = avframe->width;
+    mHeight = avframe->height;
+    mSequence = frame->sequence();
+    mCaptureTimeNs = frame->capture_time_ns();
+    mOwner = std::move(frame);
+}
+#endif
+
+}  // namespace android
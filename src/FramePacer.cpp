@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "FramePacer"
+
+#include <log/log.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include "FramePacer.h"
+
+namespace android {
+
+void FramePacer::Histogram::add(nsecs_t value) {
+    if (value < 0) value = 0;
+    size_t bucket = 0;
+    for (nsecs_t bound = kFirstBucket; value >= bound && bucket < kBuckets - 1; bound *= 2) {
+        bucket++;
+    }
+    mCounts[bucket].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mSum.fetch_add(value, std::memory_order_relaxed);
+    // Single writer, the sensor thread.
+    if (value > mMax.load(std::memory_order_relaxed)) {
+        mMax.store(value, std::memory_order_relaxed);
+    }
+}
+
+void FramePacer::Histogram::dump(int fd, const char *name) const {
+    uint64_t count = mCount.load(std::memory_order_relaxed);
+    if (count == 0) {
+        dprintf(fd, "  %s: none\n", name);
+        return;
+    }
+    dprintf(fd, "  %s: avg %" PRId64 " us, max %" PRId64 " us\n", name,
+            mSum.load(std::memory_order_relaxed) / int64_t(count) / 1000,
+            mMax.load(std::memory_order_relaxed) / 1000);
+    nsecs_t bound = kFirstBucket;
+    for (size_t i = 0; i < kBuckets; i++, bound *= 2) {
+        uint64_t n = mCounts[i].load(std::memory_order_relaxed);
+        if (n == 0) continue;
+        if (i < kBuckets - 1) {
+            dprintf(fd, "    < %6" PRId64 " us: %" PRIu64 "\n", bound / 1000, n);
+        } else {
+            dprintf(fd, "    >= %5" PRId64 " us: %" PRIu64 "\n", bound / 2000, n);
+        }
+    }
+}
+
+nsecs_t FramePacer::beginFrame(nsecs_t frameDuration) {
+    mWorkStart = systemTime();
+    if (mFrameEnd == 0) {
+        mFrameEnd = mWorkStart;
+    }
+    nsecs_t frameStart = mFrameEnd;
+    mFrameDuration = frameDuration;
+    mFrameEnd = frameStart + frameDuration;
+    mFrames.fetch_add(1, std::memory_order_relaxed);
+    return frameStart;
+}
+
+void FramePacer::endFrame() {
+    nsecs_t now = systemTime();
+    mWorkTime.add(now - mWorkStart);
+
+    // Ending right on the deadline is on time.
+    if (now > mFrameEnd) {
+        nsecs_t late = now - mFrameEnd;
+        mLateFrames.fetch_add(1, std::memory_order_relaxed);
+        mLateness.add(late);
+        if (mPolicy == LatePolicy::kCatchUp && late < kMaxCatchUpFrames * mFrameDuration) {
+            ALOGV("%s: %" PRId64 " us late, catching up", __FUNCTION__, late / 1000);
+            return;
+        }
+        // Wait for the next frame slot of the schedule, none if now is one.
+        nsecs_t skipped = mFrameDuration > 0 ? (late + mFrameDuration - 1) / mFrameDuration : 0;
+        mFrameEnd += skipped * mFrameDuration;
+        mSkippedFrames.fetch_add(skipped, std::memory_order_relaxed);
+        ALOGV("%s: %" PRId64 " us late, skipping %" PRId64 " frames", __FUNCTION__, late / 1000,
+              skipped);
+        if (now >= mFrameEnd) return;
+    }
+
+    if (sleepUntil(mFrameEnd)) {
+        mWakeUpDelay.add(systemTime() - mFrameEnd);
+    }
+}
+
+bool FramePacer::endFrameOnInput(nsecs_t minFrameDuration, nsecs_t maxFrameDuration,
+                                 const std::function<bool(nsecs_t deadline)> &waitForInput) {
+    nsecs_t now = systemTime();
+    mWorkTime.add(now - mWorkStart);
+
+    nsecs_t frameStart = mFrameEnd - mFrameDuration;
+    nsecs_t earliest = frameStart + minFrameDuration;
+    nsecs_t latest = frameStart + std::max(minFrameDuration, maxFrameDuration);
+    if (now > latest) {
+        // No time left to wait for input; the next frame starts right away.
+        mLateFrames.fetch_add(1, std::memory_order_relaxed);
+        mLateness.add(now - latest);
+        mFrameEnd = now;
+        return false;
+    }
+
+    nsecs_t workEnd = now;
+    if (now < earliest) {
+        sleepUntil(earliest);
+    }
+    if (waitForInput(latest)) {
+        now = systemTime();
+        mInputFrames.fetch_add(1, std::memory_order_relaxed);
+        mInputWait.add(now - workEnd);
+        mFrameEnd = std::max(now, earliest);
+        return true;
+    }
+    // The wait may time out on another clock, so end on this one.
+    if (sleepUntil(latest)) {
+        mWakeUpDelay.add(systemTime() - latest);
+    }
+    mFrameEnd = latest;
+    return false;
+}
+
+bool FramePacer::sleepUntil(nsecs_t time) {
+    timespec deadline;
+    deadline.tv_sec = time / 1000000000L;
+    deadline.tv_nsec = time % 1000000000L;
+    int ret;
+    do {
+        ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr);
+    } while (ret == EINTR);
+    if (ret != 0) {
+        ALOGE("%s: clock_nanosleep failed: %d", __FUNCTION__, ret);
+        return false;
+    }
+    return true;
+}
+
+void FramePacer::dump(int fd) const {
+    dprintf(fd, "Sensor frame pacing (%s late frames):\n",
+            mPolicy == LatePolicy::kCatchUp ? "catch up" : "skip");
+    dprintf(fd, "  frames: %" PRIu64 ", late: %" PRIu64 ", skipped slots: %" PRIu64 "\n",
+            mFrames.load(std::memory_order_relaxed), mLateFrames.load(std::memory_order_relaxed),
+            mSkippedFrames.load(std::memory_order_relaxed));
+    mWorkTime.dump(fd, "work time");
+    mWakeUpDelay.dump(fd, "wake-up delay");
+    mLateness.dump(fd, "lateness");
+    uint64_t inputFrames = mInputFrames.load(std::memory_order_relaxed);
+    if (inputFrames > 0) {
+        dprintf(fd, "  ended by input: %" PRIu64 "\n", inputFrames);
+        mInputWait.dump(fd, "input wait");
+    }
+}
+
+}  // namespace android
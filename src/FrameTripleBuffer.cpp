@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FrameTripleBuffer.h"
+
+namespace android {
+
+uint64_t FrameTripleBuffer::publish(IngestBufferRef frame) {
+    std::lock_guard<std::mutex> lock(mWriterMutex);
+    uint64_t sequence = mPublished.load(std::memory_order_relaxed) + 1;
+
+    Slot &slot = mSlots[mBack];
+    slot.frame = std::move(frame);
+    slot.sequence = sequence;
+    mPublished.store(sequence, std::memory_order_relaxed);
+
+    uint32_t previous = mMiddle.exchange(mBack | kNewFrame, std::memory_order_acq_rel);
+    mBack = previous & kIndexMask;
+    // Hand the replaced frame back to the ingest ring right away.
+    mSlots[mBack].frame.reset();
+
+    // Taking the lock orders the exchange above before a reader going to
+    // sleep re-checks it, so that the notification cannot be missed.
+    { std::lock_guard<std::mutex> lock(mWaitMutex); }
+    mWaitCond.notify_one();
+    return sequence;
+}
+
+IngestBufferRef FrameTripleBuffer::latest(uint64_t *sequence) {
+    if (mMiddle.load(std::memory_order_relaxed) & kNewFrame) {
+        mFront = mMiddle.exchange(mFront, std::memory_order_acq_rel) & kIndexMask;
+    }
+
+    const Slot &slot = mSlots[mFront];
+    if (slot.sequence != 0) {
+        if (slot.sequence == mLastRead) {
+            mRepeated.fetch_add(1, std::memory_order_relaxed);
+        } else if (slot.sequence > mLastRead + 1) {
+            mDropped.fetch_add(slot.sequence - mLastRead - 1, std::memory_order_relaxed);
+        }
+        mLastRead = slot.sequence;
+    }
+    if (sequence != nullptr) *sequence = slot.sequence;
+    return slot.frame;
+}
+
+bool FrameTripleBuffer::waitForNewFrame(std::chrono::steady_clock::time_point deadline) {
+    if (hasNewFrame()) return true;
+    std::unique_lock<std::mutex> lock(mWaitMutex);
+    return mWaitCond.wait_until(lock, deadline, [this] { return hasNewFrame(); });
+}
+
+}  // namespace android
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "IngestBufferPool"
+
+#include <log/log.h>
+#include <cstring>
+#include <new>
+#include "IngestBufferPool.h"
+#ifdef ENABLE_FFMPEG
+#include "CGCodec.h"
+
+static_assert(INGEST_BUFFER_PADDING_SIZE == CG_INPUT_BUFFER_PADDING_SIZE,
+              "Ingest padding must satisfy the decoder input padding");
+#endif
+
+namespace android {
+
+void IngestBuffer::setSize(size_t size) {
+    mSize = size;
+    memset(mData + size, 0, INGEST_BUFFER_PADDING_SIZE);
+}
+
+IngestBufferRef IngestBuffer::wrap(uint8_t *data, size_t size, std::function<void()> release) {
+    IngestBuffer *buffer = new IngestBuffer();
+    buffer->mData = data;
+    buffer->mCapacity = size;
+    buffer->mSize = size;
+    return IngestBufferRef(buffer, [release](IngestBuffer *b) {
+        if (release) release();
+        delete b;
+    });
+}
+
+bool IngestBuffer::reserve(size_t size) {
+    size_t required = size + INGEST_BUFFER_PADDING_SIZE;
+    if (required <= mCapacity) return true;
+
+    // Contents are not preserved; a slot is always refilled after acquire.
+    std::unique_ptr<uint8_t[]> data(new (std::nothrow) uint8_t[required]);
+    if (!data) {
+        ALOGE("%s: Failed to grow ingest buffer to %zu bytes", __FUNCTION__, required);
+        return false;
+    }
+    mStorage = std::move(data);
+    mData = mStorage.get();
+    mCapacity = required;
+    return true;
+}
+
+IngestBufferPool::IngestBufferPool(size_t numSlots) {
+    for (size_t i = 0; i < numSlots; i++) {
+        mSlots.push_back(std::make_shared<IngestBuffer>());
+    }
+}
+
+IngestBufferRef IngestBufferPool::acquire(size_t size) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    // A free slot that already fits, in ring order, so that large frames keep
+    // to as few slots as are in use at once. Otherwise the largest free slot
+    // is grown.
+    size_t required = size + INGEST_BUFFER_PADDING_SIZE;
+    size_t index = mSlots.size();
+    for (size_t i = 0; i < mSlots.size(); i++) {
+        size_t candidate = (mNext + i) % mSlots.size();
+        const std::shared_ptr<IngestBuffer> &slot = mSlots[candidate];
+        if (slot->mInUse.load(std::memory_order_relaxed)) continue;
+        if (slot->mCapacity >= required) {
+            index = candidate;
+            break;
+        }
+        if (index == mSlots.size() || slot->mCapacity > mSlots[index]->mCapacity) {
+            index = candidate;
+        }
+    }
+    if (index == mSlots.size()) {
+        ALOGV("%s: All %zu ingest buffers are in use", __FUNCTION__, mSlots.size());
+        return nullptr;
+    }
+
+    // Slots are only taken under mMutex, so a free one stays free. Acquire
+    // pairs with the release of the last reference, whose reads of the slot
+    // must be done before it is refilled.
+    std::shared_ptr<IngestBuffer> &slot = mSlots[index];
+    if (slot->mInUse.exchange(true, std::memory_order_acquire)) {
+        ALOGE("%s: Ingest buffer %zu was taken concurrently", __FUNCTION__, index);
+        return nullptr;
+    }
+    if (!slot->reserve(size)) {
+        slot->mInUse.store(false, std::memory_order_release);
+        return nullptr;
+    }
+    mNext = (index + 1) % mSlots.size();
+    slot->mSize = 0;
+    slot->setFrameInfo(0, 0);
+
+    // The deleter holds the slot storage, so outstanding references stay
+    // valid independently of the pool.
+    std::shared_ptr<IngestBuffer> owner = slot;
+    return IngestBufferRef(slot.get(), [owner](IngestBuffer *buffer) {
+        buffer->mInUse.store(false, std::memory_order_release);
+    });
+}
+
+void IngestBufferPool::trim() {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    size_t freed = 0;
+    for (std::shared_ptr<IngestBuffer> &slot : mSlots) {
+        if (slot->mInUse.load(std::memory_order_acquire) || !slot->mStorage) continue;
+        freed += slot->mCapacity;
+        slot->mStorage.reset();
+        slot->mData = nullptr;
+        slot->mCapacity = 0;
+    }
+    ALOGV("%s: Freed %zu bytes", __FUNCTION__, freed);
+}
+
+}  // namespace android
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "IoUringReceiver"
+
+#ifdef ENABLE_IO_URING
+
+#include <log/log.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "IoUringReceiver.h"
+
+namespace android {
+
+// Receives are tagged with their generation, which starts at 1.
+static const uint64_t kCancelTag = 0;
+
+IoUringReceiver::~IoUringReceiver() {
+    stop();
+    if (mBufRing != nullptr) {
+        io_uring_free_buf_ring(&mRing, mBufRing, kNumBuffers, kBufferGroup);
+    }
+    if (mRingReady) {
+        io_uring_queue_exit(&mRing);
+    }
+    if (mBuffers != nullptr) {
+        munmap(mBuffers, kNumBuffers * kBufferSize);
+    }
+    if (mEventFd >= 0) {
+        close(mEventFd);
+    }
+}
+
+bool IoUringReceiver::init() {
+    int ret = io_uring_queue_init(kQueueDepth, &mRing, 0);
+    if (ret < 0) {
+        ALOGI("%s: io_uring not available: %s", __FUNCTION__, strerror(-ret));
+        return false;
+    }
+    mRingReady = true;
+
+    mBufRing = io_uring_setup_buf_ring(&mRing, kNumBuffers, kBufferGroup, 0, &ret);
+    if (mBufRing == nullptr) {
+        ALOGI("%s: Provided buffer rings not available: %s", __FUNCTION__, strerror(-ret));
+        return false;
+    }
+
+    void *buffers = mmap(nullptr, kNumBuffers * kBufferSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        ALOGE("%s: Failed to allocate receive buffers: %s", __FUNCTION__, strerror(errno));
+        return false;
+    }
+    mBuffers = static_cast<uint8_t *>(buffers);
+    for (unsigned i = 0; i < kNumBuffers; i++) {
+        io_uring_buf_ring_add(mBufRing, mBuffers + i * kBufferSize, kBufferSize, i,
+                              io_uring_buf_ring_mask(kNumBuffers), i);
+    }
+    io_uring_buf_ring_advance(mBufRing, kNumBuffers);
+
+    mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mEventFd < 0 || io_uring_register_eventfd(&mRing, mEventFd) < 0) {
+        ALOGE("%s: Failed to register completion eventfd", __FUNCTION__);
+        return false;
+    }
+    mUsable = true;
+    ALOGI("%s: io_uring receive enabled with %u x %zu byte buffers", __FUNCTION__, kNumBuffers,
+          kBufferSize);
+    return true;
+}
+
+bool IoUringReceiver::start(int fd) {
+    if (!mUsable) return false;
+
+    mFd = fd;
+    mGeneration++;
+    return armReceive();
+}
+
+bool IoUringReceiver::armReceive() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&mRing);
+    if (sqe == nullptr) {
+        ALOGE("%s: Submission queue is full", __FUNCTION__);
+        return false;
+    }
+    io_uring_prep_recv_multishot(sqe, mFd, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+    io_uring_sqe_set_data64(sqe, mGeneration);
+
+    int ret = io_uring_submit(&mRing);
+    if (ret < 0) {
+        ALOGE("%s: Failed to submit receive: %s", __FUNCTION__, strerror(-ret));
+        return false;
+    }
+    mArmed = true;
+    return true;
+}
+
+void IoUringReceiver::recycleBuffer(uint16_t bid) {
+    io_uring_buf_ring_add(mBufRing, mBuffers + bid * kBufferSize, kBufferSize, bid,
+                          io_uring_buf_ring_mask(kNumBuffers), 0);
+    io_uring_buf_ring_advance(mBufRing, 1);
+}
+
+void IoUringReceiver::stop() {
+    if (mFd < 0) return;
+
+    struct io_uring_sqe *sqe = mArmed ? io_uring_get_sqe(&mRing) : nullptr;
+    if (sqe != nullptr) {
+        io_uring_prep_cancel64(sqe, mGeneration, 0);
+        io_uring_sqe_set_data64(sqe, kCancelTag);
+        io_uring_submit(&mRing);
+
+        // Wait for the receive to terminate, so that the ring no longer holds
+        // a reference on the socket when it is closed.
+        struct __kernel_timespec timeout = {0, 100 * 1000 * 1000};
+        struct io_uring_cqe *cqe;
+        while (mArmed && io_uring_wait_cqe_timeout(&mRing, &cqe, &timeout) == 0) {
+            uint64_t tag = io_uring_cqe_get_data64(cqe);
+            unsigned flags = cqe->flags;
+            io_uring_cqe_seen(&mRing, cqe);
+            if (flags & IORING_CQE_F_BUFFER) {
+                recycleBuffer(flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (tag == mGeneration && !(flags & IORING_CQE_F_MORE)) {
+                mArmed = false;
+            }
+        }
+    }
+    mArmed = false;
+    mFd = -1;
+}
+
+bool IoUringReceiver::processCompletions(
+    const std::function<bool(const uint8_t *, size_t)> &onData) {
+    uint64_t count;
+    while (read(mEventFd, &count, sizeof(count)) > 0) {
+    }
+
+    bool keep = true;
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&mRing, &cqe) == 0) {
+        uint64_t tag = io_uring_cqe_get_data64(cqe);
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        io_uring_cqe_seen(&mRing, cqe);
+
+        if (flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (keep && tag == mGeneration && res > 0) {
+                keep = onData(mBuffers + bid * kBufferSize, res);
+            }
+            recycleBuffer(bid);
+        }
+
+        // Cancel completions and leftovers of a previous connection.
+        if (tag != mGeneration || (flags & IORING_CQE_F_MORE)) continue;
+
+        mArmed = false;
+        if (res == 0) {
+            ALOGI("%s: Camera client closed the connection", __FUNCTION__);
+            keep = false;
+        } else if (res == -EINVAL) {
+            // Kernel without multishot receive: the receive never started.
+            ALOGI("%s: Multishot receive not supported, using recv()", __FUNCTION__);
+            mUsable = false;
+            keep = false;
+        } else if (res < 0 && res != -ENOBUFS) {
+            ALOGE("%s: Receive failed: %s", __FUNCTION__, strerror(-res));
+            keep = false;
+        } else if (keep) {
+            // Out of buffers or ended by the kernel; nothing is lost, re-arm.
+            keep = armReceive();
+        }
+    }
+    return keep;
+}
+
+}  // namespace android
+
+#endif  // ENABLE_IO_URING
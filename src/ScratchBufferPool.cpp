@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ScratchBufferPool"
+
+#include <log/log.h>
+#include <stdlib.h>
+#include "ScratchBufferPool.h"
+
+namespace android {
+
+ScratchBufferPool &ScratchBufferPool::getInstance() {
+    static ScratchBufferPool *pool = new ScratchBufferPool();
+    return *pool;
+}
+
+uint8_t *ScratchBufferPool::acquire(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    // Smallest free buffer that fits.
+    Buffer *fit = nullptr;
+    for (Buffer &buffer : mBuffers) {
+        if (!buffer.inUse && buffer.capacity >= size &&
+            (fit == nullptr || buffer.capacity < fit->capacity)) {
+            fit = &buffer;
+        }
+    }
+    if (fit != nullptr) {
+        fit->inUse = true;
+        return fit->data;
+    }
+
+    void *data = nullptr;
+    if (posix_memalign(&data, kAlignment, size) != 0) {
+        ALOGE("%s: Failed to allocate %zu bytes", __FUNCTION__, size);
+        return nullptr;
+    }
+    ALOGV("%s: Allocated %zu bytes, %zu buffers", __FUNCTION__, size, mBuffers.size() + 1);
+    mBuffers.push_back({static_cast<uint8_t *>(data), size, true});
+    return static_cast<uint8_t *>(data);
+}
+
+void ScratchBufferPool::release(uint8_t *data) {
+    if (data == nullptr) return;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    size_t numFree = 0;
+    Buffer *released = nullptr;
+    Buffer *smallest = nullptr;
+    for (Buffer &buffer : mBuffers) {
+        if (buffer.data == data) {
+            buffer.inUse = false;
+            released = &buffer;
+        }
+        if (!buffer.inUse) {
+            numFree++;
+            if (smallest == nullptr || buffer.capacity < smallest->capacity) smallest = &buffer;
+        }
+    }
+    if (released == nullptr) {
+        ALOGE("%s: %p is not from this pool", __FUNCTION__, data);
+        return;
+    }
+
+    // Keep the larger ones, which fit any smaller frame.
+    if (numFree > kMaxFreeBuffers) {
+        ALOGV("%s: Freeing %zu bytes", __FUNCTION__, smallest->capacity);
+        free(smallest->data);
+        *smallest = mBuffers.back();
+        mBuffers.pop_back();
+    }
+}
+
+}  // namespace android
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "SharedFrameRing"
+
+#include <log/log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "SharedFrameRing.h"
+
+namespace android {
+
+using namespace socket;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "Slot states are shared with another process");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Unexpected atomic layout");
+
+std::shared_ptr<SharedFrameRing> SharedFrameRing::map(int fd, const camera_shm_config_t &config,
+                                                      size_t frameSize) {
+    struct stat st;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t map_size = size_t(config.data_offset) + size_t(config.num_slots) * config.slot_size;
+
+    if (config.codec_type != uint32_t(VideoCodecType::kI420) || config.num_slots == 0 ||
+        config.num_slots > CAMERA_SHM_MAX_SLOTS || config.slot_size == 0 ||
+        config.data_offset < config.num_slots * sizeof(uint32_t) ||
+        config.data_offset % page_size != 0) {
+        ALOGE("%s: Invalid shm config: %u slots of %u bytes at %u, codec %u", __FUNCTION__,
+              config.num_slots, config.slot_size, config.data_offset, config.codec_type);
+        close(fd);
+        return nullptr;
+    }
+    if (config.slot_size < frameSize) {
+        ALOGE("%s: Slots of %u bytes cannot hold frames of %zu bytes", __FUNCTION__,
+              config.slot_size, frameSize);
+        close(fd);
+        return nullptr;
+    }
+    // Else the client could truncate the memfd under the mapping, and reading
+    // a slot would raise SIGBUS.
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        ALOGE("%s: memfd is not sealed against shrinking", __FUNCTION__);
+        close(fd);
+        return nullptr;
+    }
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) < map_size) {
+        ALOGE("%s: memfd is smaller than the %zu bytes announced", __FUNCTION__, map_size);
+        close(fd);
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        ALOGE("%s: mmap failed: %s", __FUNCTION__, strerror(errno));
+        return nullptr;
+    }
+
+    std::shared_ptr<SharedFrameRing> ring(new SharedFrameRing());
+    ring->mBase = static_cast<uint8_t *>(base);
+    ring->mMapSize = map_size;
+    ring->mConfig = config;
+    ALOGI("%s: Mapped %u shared frame slots of %u bytes", __FUNCTION__, config.num_slots,
+          config.slot_size);
+    return ring;
+}
+
+SharedFrameRing::~SharedFrameRing() {
+    if (mBase != nullptr) {
+        munmap(mBase, mMapSize);
+    }
+}
+
+std::atomic<uint32_t> *SharedFrameRing::slotState(uint32_t slot) {
+    return reinterpret_cast<std::atomic<uint32_t> *>(mBase) + slot;
+}
+
+IngestBufferRef SharedFrameRing::acquireSlot(uint32_t slot) {
+    if (slot >= mConfig.num_slots) {
+        ALOGE("%s: Invalid slot %u of %u", __FUNCTION__, slot, mConfig.num_slots);
+        return nullptr;
+    }
+    std::atomic<uint32_t> *state = slotState(slot);
+    uint32_t expected = CAMERA_SHM_SLOT_READY;
+    if (!state->compare_exchange_strong(expected, CAMERA_SHM_SLOT_BUSY,
+                                        std::memory_order_acquire)) {
+        ALOGE("%s: Slot %u was announced but is not ready", __FUNCTION__, slot);
+        return nullptr;
+    }
+
+    // The reference keeps the ring mapped until the slot is handed back.
+    std::shared_ptr<SharedFrameRing> self = shared_from_this();
+    uint8_t *data = mBase + mConfig.data_offset + size_t(slot) * mConfig.slot_size;
+    return IngestBuffer::wrap(data, mConfig.slot_size, [self, state]() {
+        state->store(CAMERA_SHM_SLOT_FREE, std::memory_order_release);
+    });
+}
+
+}  // namespace android
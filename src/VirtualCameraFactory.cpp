@@ -43,6 +43,7 @@ namespace android {
 
 bool gIsInFrameI420;
 bool gIsInFrameH264;
+bool gIsInFrameH265;
 bool gIsInFrameMJPG;
 bool gUseVaapi;
 
@@ -59,6 +60,7 @@ void VirtualCameraFactory::readSystemProperties() {
     gUseVaapi = !strcmp(prop_val, "true");
 
     gIsInFrameH264 = false;
+    gIsInFrameH265 = false;
     gIsInFrameI420 = false;
     gIsInFrameMJPG = false;
     ALOGI("%s - gIsInFrameH264: %d, gIsInFrameI420: %d, gUseVaapi: %d", __func__, gIsInFrameH264,
@@ -72,20 +74,16 @@ VirtualCameraFactory::VirtualCameraFactory()
       mCallbacks(nullptr) {
     readSystemProperties();
 
-    if (gIsInFrameH264) {
-        // Create decoder to decode H264/H265 input frames.
-        ALOGV("%s Creating decoder.", __func__);
 #ifdef ENABLE_FFMPEG
-        mDecoder = std::make_shared<CGVideoDecoder>();
+    // Create decoder to decode H264/H265 input frames. The input codec is
+    // only known once the client connected, so it is always created; it is
+    // initialized when a camera is opened.
+    ALOGV("%s Creating decoder.", __func__);
+    mDecoder = std::make_shared<CGVideoDecoder>();
 #endif
-    }
 
     // Create socket server which is used to communicate with client device.
-#ifdef ENABLE_FFMPEG
-    createSocketServer(mDecoder);
-#else
     createSocketServer();
-#endif
     ALOGV("%s socket server created: ", __func__);
 
     pthread_mutex_lock(&mCapReadLock);
@@ -126,8 +124,13 @@ bool VirtualCameraFactory::createSocketServer() {
     mCameraSessionState = socket::CameraSessionState::kNone;
     char id[PROPERTY_VALUE_MAX] = {0};
 
+#ifdef ENABLE_FFMPEG
+    mSocketServer = std::make_shared<CameraSocketServerThread>(id, mDecoder,
+                                                               std::ref(mCameraSessionState));
+#else
     mSocketServer =
         std::make_shared<CameraSocketServerThread>(id, std::ref(mCameraSessionState));
+#endif
     
     // TODO need to return false if error.
     return true;
@@ -267,19 +270,13 @@ int VirtualCameraFactory::open_legacy(const struct hw_module_t *module, const ch
 /********************************************************************************
  * Internal API
  *******************************************************************************/
-#ifdef ENABLE_FFMPEG
-void VirtualCameraFactory::createVirtualRemoteCamera(
-    std::shared_ptr<CameraSocketServerThread> socket_server,
-    std::shared_ptr<CGVideoDecoder> decoder, int cameraId) {
-#else
 void VirtualCameraFactory::createVirtualRemoteCamera(
     std::shared_ptr<CameraSocketServerThread> socket_server,
     int cameraId) {
-#endif
     ALOGV("%s: E", __FUNCTION__);
     mVirtualCameras[cameraId] =
 #ifdef ENABLE_FFMPEG
-        new VirtualFakeCamera3(cameraId, &HAL_MODULE_INFO_SYM.common, socket_server, decoder,
+        new VirtualFakeCamera3(cameraId, &HAL_MODULE_INFO_SYM.common, socket_server, mDecoder,
                                std::ref(mCameraSessionState));
 #else
  new VirtualFakeCamera3(cameraId, &HAL_MODULE_INFO_SYM.common, socket_server, 
@@ -192,6 +192,9 @@ uint32_t VirtualFakeCamera3::setDecoderResolution(uint32_t resolution) {
         case DECODER_SUPPORTED_RESOLUTION_1080P:
             res = (uint32_t)FrameResolution::k1080p;
             break;
+        case DECODER_SUPPORTED_RESOLUTION_2160P:
+            res = (uint32_t)FrameResolution::k2160p;
+            break;
         default:
             ALOGI("%s: Selected default 480p resolution!!!", __func__);
             res = (uint32_t)FrameResolution::k480p;
@@ -249,10 +252,12 @@ out:
 status_t VirtualFakeCamera3::connectCamera() {
     ALOGI(LOG_TAG "%s: E", __FUNCTION__);
 
-    if (gIsInFrameH264) {
+    if (isInFrameEncoded()) {
         const char *device_name = gUseVaapi ? "vaapi" : nullptr;
 #ifdef ENABLE_FFMPEG
-        // initialize decoder
+        // initialize decoder, reusing a warm context when the configuration
+        // did not change since the last session
+        mDecoderResolution = setDecoderResolution(gCameraMaxHeight);
         if (mDecoder->init((android::socket::FrameResolution)mDecoderResolution, mCodecType,
                            device_name, 0) < 0) {
             ALOGE("%s VideoDecoder init failed. %s decoding", __func__,
@@ -370,12 +375,11 @@ status_t VirtualFakeCamera3::closeCamera() {
     handle->reset();
     ALOGI("%s: Camera input buffers are reset", __func__);
 
-    if (gIsInFrameH264) {
+    if (isInFrameEncoded()) {
         // Set state to CameraClosed, so that SocketServerThread stops decoding.
         mCameraSessionState = socket::CameraSessionState::kCameraClosed;
 #ifdef ENABLE_FFMPEG
-        mDecoder->flush_decoder();
-        mDecoder->destroy();
+        mDecoder->close();
 #endif
         ALOGI("%s Decoding is stopped, now send CLOSE command to client", __func__);
     }
@@ -395,7 +399,6 @@ status_t VirtualFakeCamera3::closeCamera() {
     mSensor = NULL;
     mReadoutThread = NULL;
     mJpegCompressor = NULL;
-    mSocketServer->size_update = 0;
     return VirtualCamera3::closeCamera();
 }
 
@@ -617,6 +620,9 @@ status_t VirtualFakeCamera3::configureStreams(camera3_stream_configuration *stre
         ClientVideoBuffer *handle = ClientVideoBuffer::getClientInstance();
         handle->clearBuffer();
     }
+    if (mSensor != nullptr) {
+        mSensor->onStreamsConfigured();
+    }
 
     return OK;
 }
@@ -1102,6 +1108,7 @@ status_t VirtualFakeCamera3::processCaptureRequest(camera3_capture_request *requ
         destBuf.stride = srcBuf.stream->width;
         destBuf.dataSpace = srcBuf.stream->data_space;
         destBuf.buffer = srcBuf.buffer;
+        destBuf.ycbcr = android_ycbcr();
         // Set this first to get rid of klocwork warnings.
         // It would be overwritten again if it is HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED
         destBuf.format = (srcBuf.stream->format == HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED)
@@ -1170,6 +1177,7 @@ status_t VirtualFakeCamera3::processCaptureRequest(camera3_capture_request *requ
                                                                   0, 0, destBuf.width,
                                                                   destBuf.height, &ycbcr);
                     destBuf.img = static_cast<uint8_t *>(ycbcr.y);
+                    destBuf.ycbcr = ycbcr;
                 } else {
                     ALOGE("Unexpected private format for flexible YUV: 0x%x", destBuf.format);
                     res = INVALID_OPERATION;
@@ -1318,7 +1326,24 @@ status_t VirtualFakeCamera3::flush() {
 
 /** Debug methods */
 
-void VirtualFakeCamera3::dump(int fd) {}
+void VirtualFakeCamera3::dump(int fd) {
+    const FrameTripleBuffer &frames = ClientVideoBuffer::getClientInstance()->frameStats();
+    dprintf(fd, "Camera %d client frames:\n", mCameraID);
+    dprintf(fd, "  published: %" PRIu64 "\n", frames.published());
+    dprintf(fd, "  repeated:  %" PRIu64 "\n", frames.repeated());
+    dprintf(fd, "  dropped:   %" PRIu64 "\n", frames.dropped());
+    if (mSocketServer != nullptr) {
+        mSocketServer->dump(fd);
+    }
+    sp<Sensor> sensor;
+    {
+        Mutex::Autolock l(mLock);
+        sensor = mSensor;
+    }
+    if (sensor != nullptr) {
+        sensor->dump(fd);
+    }
+}
 
 /**
  * Private methods
@@ -1604,6 +1629,25 @@ status_t VirtualFakeCamera3::constructStaticInfo() {
         ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS_OUTPUT,
     };
 
+    const std::vector<int32_t> availableStreamConfigurations2160p = {
+        HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
+        1920,
+        1080,
+        ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS_OUTPUT,
+        HAL_PIXEL_FORMAT_YCrCb_420_SP,
+        1920,
+        1080,
+        ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS_OUTPUT,
+        HAL_PIXEL_FORMAT_YCbCr_420_888,
+        1920,
+        1080,
+        ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS_OUTPUT,
+        HAL_PIXEL_FORMAT_BLOB,
+        1920,
+        1080,
+        ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS_OUTPUT,
+    };
+
     const std::vector<int32_t> availableStreamConfigurations1080p = {
         HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
         1280,
@@ -1686,7 +1730,27 @@ status_t VirtualFakeCamera3::constructStaticInfo() {
     std::vector<int32_t> availableStreamConfigurations;
 
     if (hasCapability(BACKWARD_COMPATIBLE)) {
-        if (width == 1920 && height == 1080) {
+        if (width == 3840 && height == 2160) {
+            availableStreamConfigurations.insert(availableStreamConfigurations.end(),
+                                                 availableStreamConfigurations480p.begin(),
+                                                 availableStreamConfigurations480p.end());
+
+            availableStreamConfigurations.insert(availableStreamConfigurations.end(),
+                                                 availableStreamConfigurations720p.begin(),
+                                                 availableStreamConfigurations720p.end());
+
+            availableStreamConfigurations.insert(availableStreamConfigurations.end(),
+                                                 availableStreamConfigurations1080p.begin(),
+                                                 availableStreamConfigurations1080p.end());
+
+            availableStreamConfigurations.insert(availableStreamConfigurations.end(),
+                                                 availableStreamConfigurations2160p.begin(),
+                                                 availableStreamConfigurations2160p.end());
+
+            availableStreamConfigurations.insert(availableStreamConfigurations.end(),
+                                                 availableStreamConfigurationsDefault.begin(),
+                                                 availableStreamConfigurationsDefault.end());
+        } else if (width == 1920 && height == 1080) {
 
             availableStreamConfigurations.insert(availableStreamConfigurations.end(),
                                                  availableStreamConfigurations480p.begin(),
@@ -1748,6 +1812,25 @@ status_t VirtualFakeCamera3::constructStaticInfo() {
         Sensor::kFrameDurationRange[0],
     };
 
+    const std::vector<int64_t> availableMinFrameDurations2160p = {
+        HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
+        1920,
+        1080,
+        Sensor::kFrameDurationRange[0],
+        HAL_PIXEL_FORMAT_YCrCb_420_SP,
+        1920,
+        1080,
+        Sensor::kFrameDurationRange[0],
+        HAL_PIXEL_FORMAT_YCbCr_420_888,
+        1920,
+        1080,
+        Sensor::kFrameDurationRange[0],
+        HAL_PIXEL_FORMAT_BLOB,
+        1920,
+        1080,
+        Sensor::kFrameDurationRange[0],
+    };
+
     const std::vector<int64_t> availableMinFrameDurations1080p = {
         HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
         1280,
@@ -1830,7 +1913,27 @@ status_t VirtualFakeCamera3::constructStaticInfo() {
     std::vector<int64_t> availableMinFrameDurations;
 
     if (hasCapability(BACKWARD_COMPATIBLE)) {
-        if (width == 1920 && height == 1080) {
+        if (width == 3840 && height == 2160) {
+            availableMinFrameDurations.insert(availableMinFrameDurations.end(),
+                                              availableMinFrameDurationsDefault.begin(),
+                                              availableMinFrameDurationsDefault.end());
+
+            availableMinFrameDurations.insert(availableMinFrameDurations.end(),
+                                              availableMinFrameDurations2160p.begin(),
+                                              availableMinFrameDurations2160p.end());
+
+            availableMinFrameDurations.insert(availableMinFrameDurations.end(),
+                                              availableMinFrameDurations1080p.begin(),
+                                              availableMinFrameDurations1080p.end());
+
+            availableMinFrameDurations.insert(availableMinFrameDurations.end(),
+                                              availableMinFrameDurations720p.begin(),
+                                              availableMinFrameDurations720p.end());
+
+            availableMinFrameDurations.insert(availableMinFrameDurations.end(),
+                                              availableMinFrameDurations480p.begin(),
+                                              availableMinFrameDurations480p.end());
+        } else if (width == 1920 && height == 1080) {
             availableMinFrameDurations.insert(availableMinFrameDurations.end(),
                                               availableMinFrameDurationsDefault.begin(),
                                               availableMinFrameDurationsDefault.end());
@@ -1891,6 +1994,13 @@ status_t VirtualFakeCamera3::constructStaticInfo() {
         Sensor::kFrameDurationRange[0],
     };
 
+    const std::vector<int64_t> availableStallDurations2160p = {
+        HAL_PIXEL_FORMAT_BLOB,
+        1920,
+        1080,
+        Sensor::kFrameDurationRange[0],
+    };
+
     const std::vector<int64_t> availableStallDurations1080p = {
         HAL_PIXEL_FORMAT_BLOB,
         1280,
@@ -1930,7 +2040,27 @@ status_t VirtualFakeCamera3::constructStaticInfo() {
     std::vector<int64_t> availableStallDurations;
 
     if (hasCapability(BACKWARD_COMPATIBLE)) {
-        if (width == 1920 && height == 1080) {
+        if (width == 3840 && height == 2160) {
+            availableStallDurations.insert(availableStallDurations.end(),
+                                           availableStallDurationsDefault.begin(),
+                                           availableStallDurationsDefault.end());
+
+            availableStallDurations.insert(availableStallDurations.end(),
+                                           availableStallDurations2160p.begin(),
+                                           availableStallDurations2160p.end());
+
+            availableStallDurations.insert(availableStallDurations.end(),
+                                           availableStallDurations1080p.begin(),
+                                           availableStallDurations1080p.end());
+
+            availableStallDurations.insert(availableStallDurations.end(),
+                                           availableStallDurations720p.begin(),
+                                           availableStallDurations720p.end());
+
+            availableStallDurations.insert(availableStallDurations.end(),
+                                           availableStallDurations480p.begin(),
+                                           availableStallDurations480p.end());
+        } else if (width == 1920 && height == 1080) {
             availableStallDurations.insert(availableStallDurations.end(),
                                            availableStallDurationsDefault.begin(),
                                            availableStallDurationsDefault.end());
@@ -1999,7 +2129,7 @@ status_t VirtualFakeCamera3::constructStaticInfo() {
         ADD_STATIC_ENTRY(ANDROID_JPEG_AVAILABLE_THUMBNAIL_SIZES, jpegThumbnailSizes,
                          sizeof(jpegThumbnailSizes) / sizeof(int32_t));
 
-        static const int32_t jpegMaxSize = JpegCompressor::kMaxJpegSize;
+        const int32_t jpegMaxSize = JpegCompressor::maxJpegSize(width, height);
         ADD_STATIC_ENTRY(ANDROID_JPEG_MAX_SIZE, &jpegMaxSize, 1);
     }
 
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "YuvScaler"
+
+#include <log/log.h>
+#include <libyuv.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include "YuvScaler.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_SCALER_X86
+#endif
+
+namespace android {
+
+namespace {
+
+// Source index under the centre of output index i, for n outputs from m sources.
+inline int sourceIndex(int i, int n, int m) { return int(int64_t(2 * i + 1) * m / (2 * n)); }
+
+// Row kernels, n being the number of output pixels or chroma pairs.
+typedef void (*RowFunction)(const uint8_t *src, uint8_t *dst, int n);
+
+void halveRow_C(const uint8_t *src, uint8_t *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = src[2 * i + 1];
+    }
+}
+
+void halveUVRow_C(const uint8_t *src, uint8_t *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[2 * i] = src[4 * i + 2];
+        dst[2 * i + 1] = src[4 * i + 3];
+    }
+}
+
+void halveVURow_C(const uint8_t *src, uint8_t *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[2 * i] = src[4 * i + 3];
+        dst[2 * i + 1] = src[4 * i + 2];
+    }
+}
+
+void swapUVRow_C(const uint8_t *src, uint8_t *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[2 * i] = src[2 * i + 1];
+        dst[2 * i + 1] = src[2 * i];
+    }
+}
+
+#ifdef YUV_SCALER_X86
+__attribute__((target("sse4.1"))) inline __m128i swapBytes_SSE41(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse4.1"))) void halveRow_SSE41(const uint8_t *src, uint8_t *dst, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + 2 * i)), 8);
+        __m128i b = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + 2 * i + 16)), 8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+    }
+    halveRow_C(src + 2 * i, dst + i, n - i);
+}
+
+__attribute__((target("sse4.1"))) void halveUVRow_SSE41(const uint8_t *src, uint8_t *dst, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(src + 4 * i)), 16);
+        __m128i b = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(src + 4 * i + 16)), 16);
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_packus_epi32(a, b));
+    }
+    halveUVRow_C(src + 4 * i, dst + 2 * i, n - i);
+}
+
+__attribute__((target("sse4.1"))) void halveVURow_SSE41(const uint8_t *src, uint8_t *dst, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(src + 4 * i)), 16);
+        __m128i b = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(src + 4 * i + 16)), 16);
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), swapBytes_SSE41(_mm_packus_epi32(a, b)));
+    }
+    halveVURow_C(src + 4 * i, dst + 2 * i, n - i);
+}
+
+__attribute__((target("sse4.1"))) void swapUVRow_SSE41(const uint8_t *src, uint8_t *dst, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), swapBytes_SSE41(v));
+    }
+    swapUVRow_C(src + 2 * i, dst + 2 * i, n - i);
+}
+
+// AVX2 packs within 128 bit lanes, hence the permute back into order.
+__attribute__((target("avx2"))) inline __m256i swapBytes_AVX2(__m256i v) {
+    return _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+}
+
+__attribute__((target("avx2"))) void halveRow_AVX2(const uint8_t *src, uint8_t *dst, int n) {
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(src + 2 * i)), 8);
+        __m256i b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(src + 2 * i + 32)), 8);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst + i), packed);
+    }
+    halveRow_C(src + 2 * i, dst + i, n - i);
+}
+
+__attribute__((target("avx2"))) void halveUVRow_AVX2(const uint8_t *src, uint8_t *dst, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(src + 4 * i)), 16);
+        __m256i b = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(src + 4 * i + 32)), 16);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), packed);
+    }
+    halveUVRow_C(src + 4 * i, dst + 2 * i, n - i);
+}
+
+__attribute__((target("avx2"))) void halveVURow_AVX2(const uint8_t *src, uint8_t *dst, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(src + 4 * i)), 16);
+        __m256i b = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(src + 4 * i + 32)), 16);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), swapBytes_AVX2(packed));
+    }
+    halveVURow_C(src + 4 * i, dst + 2 * i, n - i);
+}
+
+__attribute__((target("avx2"))) void swapUVRow_AVX2(const uint8_t *src, uint8_t *dst, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), swapBytes_AVX2(v));
+    }
+    swapUVRow_C(src + 2 * i, dst + 2 * i, n - i);
+}
+#endif  // YUV_SCALER_X86
+
+struct RowKernels {
+    RowFunction halveRow = halveRow_C;
+    RowFunction halveUVRow = halveUVRow_C;
+    RowFunction halveVURow = halveVURow_C;
+    RowFunction swapUVRow = swapUVRow_C;
+};
+
+RowKernels selectKernels() {
+    RowKernels k;
+    const char *name = "C";
+#ifdef YUV_SCALER_X86
+    // libyuv's detection, so that its LIBYUV_DISABLE_* overrides apply here too.
+    if (libyuv::TestCpuFlag(libyuv::kCpuHasAVX2)) {
+        k.halveRow = halveRow_AVX2;
+        k.halveUVRow = halveUVRow_AVX2;
+        k.halveVURow = halveVURow_AVX2;
+        k.swapUVRow = swapUVRow_AVX2;
+        name = "AVX2";
+    } else if (libyuv::TestCpuFlag(libyuv::kCpuHasSSE41)) {
+        k.halveRow = halveRow_SSE41;
+        k.halveUVRow = halveUVRow_SSE41;
+        k.halveVURow = halveVURow_SSE41;
+        k.swapUVRow = swapUVRow_SSE41;
+        name = "SSE4.1";
+    }
+#endif
+    ALOGI("%s: Using %s row kernels", __FUNCTION__, name);
+    return k;
+}
+
+const RowKernels &kernels() {
+    static const RowKernels k = selectKernels();
+    return k;
+}
+
+}  // namespace
+
+void YuvScaler::prepare(const FrameHandle &in, int width, int height) {
+    if (!in || width <= 0 || height <= 0) return;
+    if (in.width() == mSrcWidth && in.height() == mSrcHeight && width == mDstWidth &&
+        height == mDstHeight) {
+        return;
+    }
+    mSrcWidth = in.width();
+    mSrcHeight = in.height();
+    mDstWidth = width;
+    mDstHeight = height;
+
+    mLumaColumns.resize(width);
+    for (int x = 0; x < width; x++) {
+        mLumaColumns[x] = sourceIndex(x, width, mSrcWidth);
+    }
+    int dstChromaWidth = (width + 1) / 2;
+    mChromaColumns.resize(dstChromaWidth);
+    for (int x = 0; x < dstChromaWidth; x++) {
+        mChromaColumns[x] = sourceIndex(x, dstChromaWidth, (mSrcWidth + 1) / 2);
+    }
+}
+
+void YuvScaler::scaleRows(const FrameHandle &in, uint8_t *dstY, int dstStrideY, uint8_t *dstUV,
+                          int dstStrideUV, int firstRow, int rows, bool vuOrder) const {
+    const RowKernels &k = kernels();
+
+    for (int y = 0; y < rows; y++) {
+        int srcRow = sourceIndex(firstRow + y, mDstHeight, mSrcHeight);
+        const uint8_t *src = in.data(0) + size_t(in.stride(0)) * srcRow;
+        uint8_t *dst = dstY + size_t(dstStrideY) * y;
+        if (mSrcWidth == mDstWidth) {
+            memcpy(dst, src, mDstWidth);
+        } else if (mSrcWidth == 2 * mDstWidth) {
+            k.halveRow(src, dst, mDstWidth);
+        } else {
+            for (int x = 0; x < mDstWidth; x++) {
+                dst[x] = src[mLumaColumns[x]];
+            }
+        }
+    }
+
+    // firstRow is even, so chroma rows start at its half.
+    int srcChromaWidth = (mSrcWidth + 1) / 2;
+    int srcChromaHeight = (mSrcHeight + 1) / 2;
+    int dstChromaWidth = (mDstWidth + 1) / 2;
+    int dstChromaHeight = (mDstHeight + 1) / 2;
+    int firstChromaRow = firstRow / 2;
+    int endChromaRow = (firstRow + rows + 1) / 2;
+    for (int cy = firstChromaRow; cy < endChromaRow; cy++) {
+        int srcRow = sourceIndex(cy, dstChromaHeight, srcChromaHeight);
+        uint8_t *dst = dstUV + size_t(dstStrideUV) * (cy - firstChromaRow);
+        if (in.layout() == FrameHandle::Layout::kNV12) {
+            const uint8_t *src = in.data(1) + size_t(in.stride(1)) * srcRow;
+            if (srcChromaWidth == dstChromaWidth) {
+                if (vuOrder) {
+                    k.swapUVRow(src, dst, dstChromaWidth);
+                } else {
+                    memcpy(dst, src, 2 * dstChromaWidth);
+                }
+            } else if (srcChromaWidth == 2 * dstChromaWidth) {
+                (vuOrder ? k.halveVURow : k.halveUVRow)(src, dst, dstChromaWidth);
+            } else {
+                int first = vuOrder ? 1 : 0;
+                for (int x = 0; x < dstChromaWidth; x++) {
+                    const uint8_t *pair = src + 2 * mChromaColumns[x];
+                    dst[2 * x] = pair[first];
+                    dst[2 * x + 1] = pair[1 - first];
+                }
+            }
+        } else {
+            const uint8_t *first = in.data(1) + size_t(in.stride(1)) * srcRow;
+            const uint8_t *second = in.data(2) + size_t(in.stride(2)) * srcRow;
+            if (vuOrder) std::swap(first, second);
+            for (int x = 0; x < dstChromaWidth; x++) {
+                dst[2 * x] = first[mChromaColumns[x]];
+                dst[2 * x + 1] = second[mChromaColumns[x]];
+            }
+        }
+    }
+}
+
+void YuvScaler::toSemiPlanarRows(const FrameHandle &in, uint8_t *dstY, int dstStrideY,
+                                 uint8_t *dstUV, int dstStrideUV, int firstRow, int rows,
+                                 bool vuOrder) const {
+    if (!in || in.width() != mSrcWidth || in.height() != mSrcHeight || rows <= 0) return;
+    scaleRows(in, dstY + size_t(dstStrideY) * firstRow, dstStrideY,
+              dstUV + size_t(dstStrideUV) * (firstRow / 2), dstStrideUV, firstRow, rows, vuOrder);
+}
+
+void YuvScaler::toABGRRows(const FrameHandle &in, uint8_t *dst, int dstStride, int firstRow,
+                           int rows) const {
+    if (!in || in.width() != mSrcWidth || in.height() != mSrcHeight || rows <= 0) return;
+
+    // One window per thread, as bands may be made concurrently.
+    thread_local std::vector<uint8_t> window;
+    int windowStrideUV = (mDstWidth + 1) & ~1;
+    size_t windowSizeY = size_t(mDstWidth) * kWindowRows;
+    size_t windowSize = windowSizeY + size_t(windowStrideUV) * (kWindowRows / 2);
+    if (window.size() < windowSize) {
+        window.resize(windowSize);
+    }
+    uint8_t *windowY = window.data();
+    uint8_t *windowUV = window.data() + windowSizeY;
+
+    for (int y = firstRow; y < firstRow + rows; y += kWindowRows) {
+        int windowRows = std::min(int(kWindowRows), firstRow + rows - y);
+        scaleRows(in, windowY, mDstWidth, windowUV, windowStrideUV, y, windowRows, false);
+        libyuv::NV12ToABGR(windowY, mDstWidth, windowUV, windowStrideUV,
+                           dst + size_t(dstStride) * y, dstStride, mDstWidth, windowRows);
+    }
+}
+
+}  // namespace android
@@ -24,6 +24,7 @@
 #include "VirtualFakeCamera3.h"
 #include "Exif.h"
 #include "Thumbnail.h"
+#include "ScratchBufferPool.h"
 #include "hardware/camera3.h"
 
 namespace android {
@@ -221,7 +222,7 @@ void JpegCompressor::cleanUp() {
 
     if (mFoundAux) {
         if (mAuxBuffer.streamId == 0) {
-            delete[] mAuxBuffer.img;
+            ScratchBufferPool::getInstance().release(mAuxBuffer.img);
         } else if (!mSynchronous) {
             mListener->onJpegInputDone(mAuxBuffer);
         }
@@ -29,9 +29,10 @@
 #include "CGCodec.h"
 #endif
 #include <libyuv.h>
+#include <algorithm>
 #include <log/log.h>
+#include <cinttypes>
 #include <cmath>
-#include <future>
 #include <mutex>
 #include <cstdlib>
 #include <cutils/properties.h>
@@ -39,7 +40,9 @@
 #include <chrono>
 #include <thread>
 #include <string>
+#include <string.h>
 #include "VirtualBuffer.h"
+#include "ScratchBufferPool.h"
 #include "system/camera_metadata.h"
 #include "GrallocModule.h"
 
@@ -133,7 +136,6 @@ Sensor::Sensor(uint32_t width, uint32_t height)
     // It is based on client camera capability info.
     mSrcWidth = width;
     mSrcHeight = height;
-    mSrcFrameSize = mSrcWidth * mSrcHeight * BPP_NV12;
 }
 
 Sensor::~Sensor() { 
@@ -157,6 +159,30 @@ status_t Sensor::startUp() {
     m_major_version = (module->module_api_version >> 8) & 0xff;
     ALOGI(LOG_TAG " m_major_version[%d]", m_major_version);
 
+    // Workers besides the sensor thread for capture groups and bands.
+    char prop_val[PROPERTY_VALUE_MAX] = {'\0'};
+    property_get("vendor.camera.sensor.capture_workers", prop_val, "2");
+    int workers = atoi(prop_val);
+    // Optional CPUs to pin them to, e.g. "2-3"; best set per instance.
+    property_get("vendor.camera.sensor.capture_cpus", prop_val, "");
+    std::vector<int> cpus = CaptureWorkerPool::parseCpuList(prop_val);
+    if (cpus.empty() && prop_val[0] != '\0') {
+        ALOGW("%s: Ignoring invalid capture CPU list \"%s\"", __FUNCTION__, prop_val);
+    }
+    mCapturePool.reset(workers > 0 ? new CaptureWorkerPool(workers, cpus) : nullptr);
+    mCaptureBands = 1;
+    mCaptureDuration = 0;
+
+    property_get("vendor.camera.sensor.late_frames", prop_val, "catchup");
+    mPacer.setLatePolicy(strcmp(prop_val, "skip") ? FramePacer::LatePolicy::kCatchUp
+                                                  : FramePacer::LatePolicy::kSkip);
+    mPacer.reset();
+
+    property_get("vendor.camera.sensor.mode", prop_val, "timer");
+    mPushMode = !strcmp(prop_val, "push");
+    mLastCaptureTime = 0;
+    ALOGI(LOG_TAG "%s: Frames driven by %s", __FUNCTION__, mPushMode ? "client input" : "timer");
+
     res = run("Sensor", ANDROID_PRIORITY_URGENT_DISPLAY);
 
     if (res != OK) {
@@ -173,11 +199,30 @@ status_t Sensor::shutDown() {
     if (res != OK) {
         ALOGE("Unable to shut down sensor capture thread: %d", res);
     }
+    mCapturePool.reset();
+    // Gives cached conversions back to the scratch buffer pool.
+    mCaptureWorkers.clear();
+    mHeldOutputs.clear();
     return res;
 }
 
 Scene &Sensor::getScene() { return mScene; }
 
+void Sensor::dump(int fd) {
+    mPacer.dump(fd);
+    dprintf(fd, "Sensor outputs: converted %" PRIu64 ", copied %" PRIu64 ", already held %" PRIu64
+                "\n",
+            mOutputsConverted.load(std::memory_order_relaxed),
+            mOutputsCopied.load(std::memory_order_relaxed),
+            mOutputsHeld.load(std::memory_order_relaxed));
+}
+
+void Sensor::onStreamsConfigured() {
+    std::lock_guard<std::mutex> lock(mHeldOutputsMutex);
+    mHeldOutputs.clear();
+    mConfiguration++;
+}
+
 void Sensor::setExposureTime(uint64_t ns) {
     Mutex::Autolock lock(mControlMutex);
     ALOGVV("Exposure set to %f", ns / 1000000.f);
@@ -364,11 +409,11 @@ bool Sensor::threadLoop() {
     Buffers *capturedBuffers = nullptr;
     nsecs_t captureTime = 0;
 
-    nsecs_t startRealTime = systemTime();
+    // Frames start on an absolute schedule, whenever the thread got here.
+    nsecs_t startRealTime = mPacer.beginFrame(frameDuration);
     // Stagefright cares about system time for timestamps, so base simulated
     // time on that.
     nsecs_t simulatedTime = startRealTime;
-    nsecs_t frameEndRealTime = startRealTime + frameDuration;
 
     if (mNextCapturedBuffers != nullptr) {
         ALOGVV("Sensor starting readout");
@@ -404,6 +449,36 @@ bool Sensor::threadLoop() {
     mNextCapturedBuffers = nextBuffers;
 
     if (mNextCapturedBuffers != nullptr) {
+        // Raw input: take the latest client frame. Encoded input: keep the last
+        // decoded frame until a new one is decoded on first use in this cycle.
+        if (!isInFrameEncoded() || !mInputFrame) {
+            uint64_t sequence;
+            IngestBufferRef frame =
+                ClientVideoBuffer::getClientInstance()->latestFrame(&sequence);
+            mInputFrame = FrameHandle(frame, mSrcWidth, mSrcHeight,
+                                      (gIsInFrameI420 || gIsInFrameMJPG)
+                                          ? FrameHandle::Layout::kI420
+                                          : FrameHandle::Layout::kNV12);
+            if (sequence != mInputSequence) {
+                mInputSequence = sequence;
+                mInputGeneration++;
+            }
+            ALOGVV("%s: Capturing client frame #%" PRIu64, __FUNCTION__, sequence);
+        }
+        mInputFrameDecoded = false;
+        #ifdef CROP_ROTATE
+        if (mInputFrame) {
+            bufferCropAndRotate(const_cast<uint8_t *>(mInputFrame.data(0)), (uint8_t*)buffer_recv);
+            mInputFrame = FrameHandle(IngestBuffer::wrap((uint8_t *)buffer_recv,
+                                                         sizeof(buffer_recv), [] {}),
+                                      640, 480, FrameHandle::Layout::kI420);
+        }
+        #endif
+        if (mPushMode) {
+            // Stamped with the client frame rather than the sensor schedule.
+            mNextCaptureTime = inputCaptureTime(mNextCaptureTime);
+        }
+
         if (listener != nullptr) {
             listener->onSensorEvent(frameNumber, SensorListener::EXPOSURE_START, mNextCaptureTime);
         }
@@ -412,14 +487,8 @@ bool Sensor::threadLoop() {
         mScene.setExposureDuration((float)exposureDuration / 1e9);
         mScene.calculateScene(mNextCaptureTime);
 
-        ClientVideoBuffer *handle = ClientVideoBuffer::getClientInstance();
-        handle->clientBuf[handle->clientRevCount % 1].decoded = false;
-        #ifdef CROP_ROTATE
-        char *fbuffer = (char *)handle->clientBuf[handle->clientRevCount % 1].buffer;
-        bufferCropAndRotate((uint8_t*)fbuffer, (uint8_t*)buffer_recv);
-        #endif
-
         // Might be adding more buffers, so size isn't constant
+        mNumCaptureGroups = 0;
         for (size_t i = 0; i < mNextCapturedBuffers->size(); i++) {
             const StreamBuffer &b = (*mNextCapturedBuffers)[i];
             ALOGVV(
@@ -434,7 +503,9 @@ bool Sensor::threadLoop() {
                     captureRGB(b.img, gain, b.width, b.height);
                     break;
                 case HAL_PIXEL_FORMAT_RGBA_8888:
-                    captureRGBA(b.img, gain, b.width, b.height);
+                case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+                case HAL_PIXEL_FORMAT_YCbCr_420_888:
+                    planCapture(i);
                     break;
                 case HAL_PIXEL_FORMAT_BLOB:
                     if (b.dataSpace != HAL_DATASPACE_DEPTH) {
@@ -448,18 +519,19 @@ bool Sensor::threadLoop() {
                         bAux.format = HAL_PIXEL_FORMAT_YCrCb_420_SP;
                         bAux.stride = b.width;
                         bAux.buffer = nullptr;
-                        bAux.img = new uint8_t[b.width * b.height * 3];
+                        // NV21, returned to the pool by the JPEG compressor.
+                        size_t auxSize = size_t(b.width) * b.height +
+                                         size_t((b.width + 1) & ~1) * ((b.height + 1) / 2);
+                        bAux.img = ScratchBufferPool::getInstance().acquire(auxSize);
+                        if (bAux.img == nullptr) {
+                            ALOGE("%s: No JPEG source buffer, no output", __FUNCTION__);
+                            break;
+                        }
                         mNextCapturedBuffers->push_back(bAux);
                     } else {
                         captureDepthCloud(b.img);
                     }
                     break;
-                case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-                    captureNV21(b.img, gain, b.width, b.height);
-                    break;
-                case HAL_PIXEL_FORMAT_YCbCr_420_888:
-                    captureNV12(b.img, gain, b.width, b.height);
-                    break;
                 case HAL_PIXEL_FORMAT_YV12:
                     // TODO:
                     ALOGE("%s: Format %x is TODO", __FUNCTION__, b.format);
@@ -472,29 +544,24 @@ bool Sensor::threadLoop() {
                     break;
             }
         }
+        captureClientFrame();
     }
+    updateCaptureBands(frameDuration);
 
     ALOGVV("Sensor Thread stage X :3");
 
     ALOGVV("Sensor Thread stage E :4");
     ALOGVV("Sensor vertical blanking interval");
-    nsecs_t workDoneRealTime = systemTime();
-    const nsecs_t timeAccuracy =
-        3e6;  // 3 ms of imprecision is ok. TODO: This imprecision needs to be revisted.
-    if (workDoneRealTime < frameEndRealTime - timeAccuracy) {
-        timespec t;
-        t.tv_sec = (frameEndRealTime - timeAccuracy - workDoneRealTime) / 1000000000L;
-        t.tv_nsec = (frameEndRealTime - timeAccuracy - workDoneRealTime) % 1000000000L;
-
-        int ret;
-        do {
-            ret = nanosleep(&t, &t);
-        } while (ret != 0);
+    ALOGVV("Frame No: %d took %d ms, target %d ms", frameNumber,
+           (int)(systemTime() - startRealTime) / 1000000, (int)(frameDuration / 1000000));
+    if (mPushMode) {
+        mPacer.endFrameOnInput(kFrameDurationRange[0], frameDuration * kPushTimeoutFrames,
+                               [this](nsecs_t deadline) { return waitForInput(deadline); });
+    } else {
+        mPacer.endFrame();
     }
 
     ALOGVV("Sensor Thread stage X :4");
-    ALOGVV("Frame No: %d took %d ms, target %d ms", frameNumber,
-           (int)(workDoneRealTime - startRealTime) / 1000000, (int)(frameDuration / 1000000));
     return true;
 };
 
@@ -541,12 +608,6 @@ void Sensor::captureRaw(uint8_t *img, uint32_t gain, uint32_t stride) {
 void Sensor::dump_yuv(uint8_t *img1, size_t img1_size, uint8_t *img2, size_t img2_size,
                       const std::string &filename) {
     static size_t count = 0;
-    ClientVideoBuffer *handle = ClientVideoBuffer::getClientInstance();
-    #ifdef CROP_ROTATE
-    uint8_t *bufData = (uint8_t *)buffer_recv;
-    #else
-    uint8_t *bufData = handle->clientBuf[handle->clientRevCount % 1].buffer;
-    #endif
 
     if (++count == 120) return;
     if (filename.empty()) {
@@ -563,220 +624,393 @@ void Sensor::dump_yuv(uint8_t *img1, size_t img1_size, uint8_t *img2, size_t img
     fclose(f);
 }
 #ifdef ENABLE_FFMPEG
-bool Sensor::getNV12Frames(uint8_t *input_buf, int *camera_input_size,
-                           std::chrono::milliseconds timeout_ms /* default 5ms */) {
-    auto cg_video_frame = std::make_shared<CGVideoFrame>();
-    size_t retry_count = 0;
-    size_t maxRetryCount;
-
-    if (!gUseVaapi) {  // SW decoding
-        timeout_ms = 10ms;
-        maxRetryCount = 10;
-    } else {
-        maxRetryCount = 5;
+FrameHandle Sensor::getDecodedFrame(std::chrono::milliseconds timeout_ms /* default 30ms */) {
+    if (!gUseVaapi && timeout_ms > 0ms) {  // SW decoding
+        timeout_ms = 100ms;
     }
 
-    do {
-        int ret = mDecoder->get_decoded_frame(cg_video_frame);
-        if (ret == 0) {  // success
-            ALOGVV("%s frames are decoded", __func__);
-            break;
-        } else if (retry_count++ <= maxRetryCount) {  // decoded frames are not ready
-            ALOGVV("%s retry #%zu get_decoded_frame() not ready, lets wait for %zums", __func__,
-                   retry_count, size_t(timeout_ms.count()));
-            std::this_thread::sleep_for(timeout_ms);
-            continue;
-        } else if (retry_count > maxRetryCount) {
-            ALOGE(
-                "%s Failed to get decoded frames even after retrying %zu times with total timeout "
-                "of %zums",
-                __func__, (retry_count - 1), (retry_count - 1) * size_t(timeout_ms.count()));
-            return false;
-        }
-    } while (true);
+    // Woken as soon as the decoder thread queues a frame.
+    auto deadline = std::chrono::steady_clock::now() + timeout_ms;
+    CGVideoFrame::Ptr decoded = mDecoder->acquire_frame(deadline);
+    if (decoded == nullptr) {
+        ALOGE("%s Failed to get decoded frames within %zums", __func__,
+              size_t(timeout_ms.count()));
+        return FrameHandle();
+    }
 
-    cg_video_frame->copy_to_buffer(input_buf, camera_input_size);
-    ALOGVV("%s converted to format: %s size: %d \n", __FUNCTION__,
-           cg_video_frame->format() == NV12 ? "NV12" : "I420", *camera_input_size);
-    ALOGVV("%s decoded buffers are copied", __func__);
+    // Read in place: the decoder buffer is held until the next frame replaces it.
+    FrameHandle frame(decoded);
+    if (!frame) {
+        ALOGE("%s Unsupported decoded frame format %d", __func__, decoded->av_frame()->format);
+        return frame;
+    }
+    ALOGVV("%s decoded %s frame #%" PRIu64 " %dx%d", __func__,
+           frame.layout() == FrameHandle::Layout::kNV12 ? "NV12" : "I420", frame.sequence(),
+           frame.width(), frame.height());
+    return frame;
+}
+#endif
 
-    return true;
+const FrameHandle *Sensor::getInputFrame() {
+#ifdef ENABLE_FFMPEG
+    if (isInFrameEncoded() && !mInputFrameDecoded) {
+        ClientVideoBuffer *handle = ClientVideoBuffer::getClientInstance();
+        // To get the decoded frame; on failure the previous one is reused.
+        // In push mode a decoded frame is either ready already or not coming.
+        FrameHandle frame = mPushMode ? getDecodedFrame(0ms) : getDecodedFrame();
+        if (frame) {
+            mInputFrame = std::move(frame);
+            mInputGeneration++;
+        }
+        mInputFrameDecoded = true;
+        std::unique_lock<std::mutex> ulock(client_buf_mutex);
+        handle->decodedFrameNo++;
+        ALOGVV("%s Decoded Camera Input Frame No: %zd", __FUNCTION__, handle->decodedFrameNo);
+        ulock.unlock();
+    }
+#endif
+    if (!mInputFrame) {
+        ALOGE("%s: No camera input frame available", __FUNCTION__);
+        return nullptr;
+    }
+    return &mInputFrame;
 }
+
+bool Sensor::waitForInput(nsecs_t deadline) {
+    auto steadyDeadline =
+        std::chrono::steady_clock::now() + std::chrono::nanoseconds(deadline - systemTime());
+#ifdef ENABLE_FFMPEG
+    if (isInFrameEncoded()) {
+        return mDecoder != nullptr && mDecoder->wait_for_frame(steadyDeadline);
+    }
 #endif
-void Sensor::captureRGBA(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height) {
-    ALOGVV("%s: E", __FUNCTION__);
+    return ClientVideoBuffer::getClientInstance()->waitForFrame(steadyDeadline);
+}
+
+nsecs_t Sensor::inputCaptureTime(nsecs_t fallback) {
+    // Taken, and decoded input acquired, now rather than on first use, for
+    // its capture time. Repeated frames get the fallback.
+    nsecs_t time = fallback;
+    const FrameHandle *in = getInputFrame();
+    if (in != nullptr && in->captureTimeNs() > mLastCaptureTime &&
+        in->captureTimeNs() <= systemTime()) {
+        time = in->captureTimeNs();
+    }
+    // Sensor timestamps must increase.
+    time = std::max(time, mLastCaptureTime + 1);
+    mLastCaptureTime = time;
+    return time;
+}
 
-    auto *handle = ClientVideoBuffer::getClientInstance();
-    #ifdef CROP_ROTATE
-    uint8_t *bufData = (uint8_t *)buffer_recv;
-    #else
-    uint8_t *bufData = handle->clientBuf[handle->clientRevCount % 1].buffer;
-    #endif
-    int cameraInputDataSize;
+void Sensor::planCapture(size_t index) {
+    const StreamBuffer &b = (*mNextCapturedBuffers)[index];
+    for (size_t g = 0; g < mNumCaptureGroups; g++) {
+        CaptureGroup &group = mCaptureGroups[g];
+        if (group.width == b.width && group.height == b.height) {
+            group.buffers.push_back(index);
+            return;
+        }
+    }
 
-    if (!gIsInFrameI420 && !gIsInFrameH264 && !gIsInFrameMJPG) {
+    if (mNumCaptureGroups == mCaptureGroups.size()) {
+        mCaptureGroups.emplace_back();
+    }
+    CaptureGroup &group = mCaptureGroups[mNumCaptureGroups++];
+    group.width = b.width;
+    group.height = b.height;
+    group.buffers.clear();
+    group.buffers.push_back(index);
+}
+
+void Sensor::captureClientFrame() {
+    if (mNumCaptureGroups == 0) return;
+
+    if (!gIsInFrameI420 && !isInFrameEncoded() && !gIsInFrameMJPG) {
         ALOGE("%s Exit - only H264, H265, I420 input frames supported", __FUNCTION__);
         return;
     }
+    // Decoded once per cycle and shared by all outputs.
+    const FrameHandle *in = getInputFrame();
+    if (in == nullptr) {
+        return;
+    }
 
-    // Initialize the input data size based on client camera resolution.
-    cameraInputDataSize = mSrcFrameSize;
+    // Conversions are only worth keeping while client frames repeat.
+    if (mInputGeneration == mCapturedGeneration) {
+        mCacheFrames = kCacheRepeatFrames;
+    } else if (mCacheFrames > 0) {
+        mCacheFrames--;
+    }
+    mCapturedGeneration = mInputGeneration;
 
-#ifdef ENABLE_FFMPEG
-    if (gIsInFrameH264) {
-        if (handle->clientBuf[handle->clientRevCount % 1].decoded) {
-            // Note: bufData already assigned in the function start
-            ALOGVV("%s - Already Decoded Camera Input Frame..", __FUNCTION__);
-        } else {  // This is the default condition in all apps.
-                  // To get the decoded frame.
-            getNV12Frames(bufData, &cameraInputDataSize);
-            handle->clientBuf[handle->clientRevCount % 1].decoded = true;
-            std::unique_lock<std::mutex> ulock(client_buf_mutex);
-            handle->decodedFrameNo++;
-            ALOGVV("%s Decoded Camera Input Frame No: %zd with size of %d", __FUNCTION__,
-                   handle->decodedFrameNo, cameraInputDataSize);
-            ulock.unlock();
+    nsecs_t start = systemTime();
+    if (mCaptureWorkers.size() < mNumCaptureGroups) {
+        mCaptureWorkers.resize(mNumCaptureGroups);
+    }
+    // Groups write to different buffers, so they run alongside each other.
+    if (mCapturePool != nullptr) {
+        mCapturePool->run(mNumCaptureGroups, [this, in](size_t g) { captureGroup(*in, g); });
+    } else {
+        for (size_t g = 0; g < mNumCaptureGroups; g++) {
+            captureGroup(*in, g);
         }
     }
-#endif
-    int src_size = mSrcWidth * mSrcHeight;
-    int dstFrameSize = width * height;
+    mCaptureDuration = systemTime() - start;
+}
+
+void Sensor::updateCaptureBands(nsecs_t frameDuration) {
+    if (mCapturePool == nullptr || mCaptureDuration == 0) return;
+
+    size_t bands = mCaptureBands;
+    if (mCaptureDuration > frameDuration * 3 / 4) {
+        bands = std::min(bands + 1, mCapturePool->workers() + 1);
+    } else if (bands > 1 &&
+               mCaptureDuration * nsecs_t(bands) / nsecs_t(bands - 1) < frameDuration / 2) {
+        bands--;
+    }
+    if (bands != mCaptureBands) {
+        ALOGI("%s: Capture took %" PRId64 " us of a %" PRId64 " us frame, %zu bands", __FUNCTION__,
+              mCaptureDuration / 1000, frameDuration / 1000, bands);
+        mCaptureBands = bands;
+    }
+    mCaptureDuration = 0;
+}
+
+void Sensor::forEachBand(uint32_t height, const std::function<void(int, int)> &band) {
+    // Below this, a band costs more to hand out than to convert.
+    const uint32_t kMinBandRows = 64;
+    size_t bands = std::min<size_t>(mCaptureBands, height / kMinBandRows);
+    if (mCapturePool == nullptr || bands <= 1) {
+        band(0, height);
+        return;
+    }
+    // Even, so that each 4:2:0 chroma row belongs to a single band.
+    int bandRows = ((height + bands - 1) / bands + 1) & ~1;
+    mCapturePool->run(bands, [&](size_t i) {
+        int firstRow = int(i) * bandRows;
+        if (firstRow < int(height)) {
+            band(firstRow, std::min(bandRows, int(height) - firstRow));
+        }
+    });
+}
+
+void Sensor::captureGroup(const FrameHandle &in, size_t g) {
+    const CaptureGroup &group = mCaptureGroups[g];
+    CaptureWorker &worker = mCaptureWorkers[g];
+
+    if (mCacheFrames == 0) {
+        worker.outputs.clear();
+    }
+    worker.pending.clear();
+    for (size_t index : group.buffers) {
+        if (!reuseOutput(worker, (*mNextCapturedBuffers)[index])) {
+            worker.pending.push_back(index);
+        }
+    }
+    if (worker.pending.empty()) return;
+
+    // Outputs sharing a scaled size are made from one scaled frame: copied,
+    // chroma swapped or converted to RGBA at 1:1.
+    ScratchBuffer scaledFrame;  // Outlives source
+    FrameHandle source = in;
+    bool scaled = group.width != uint32_t(in.width()) || group.height != uint32_t(in.height());
+    if (worker.pending.size() > 1 && scaled && group.width % 2 == 0 && group.height % 2 == 0) {
+        size_t lumaSize = size_t(group.width) * group.height;
+        size_t frameSize = lumaSize + lumaSize / 2;
+        // Without one, each output is scaled on its own.
+        scaledFrame.reset(ScratchBufferPool::getInstance().acquire(frameSize));
+    }
+    if (scaledFrame) {
+        size_t lumaSize = size_t(group.width) * group.height;
+        uint8_t *y = scaledFrame.get();
+        worker.scaler.prepare(in, group.width, group.height);
+        forEachBand(group.height, [&](int row, int rows) {
+            worker.scaler.toSemiPlanarRows(in, y, group.width, y + lumaSize, group.width, row,
+                                           rows, false);
+        });
+        source = FrameHandle(IngestBuffer::wrap(y, lumaSize + lumaSize / 2, [] {}), group.width,
+                             group.height, FrameHandle::Layout::kNV12);
+        ALOGVV("%s: %zu outputs from one %ux%u frame", __FUNCTION__, worker.pending.size(),
+               group.width, group.height);
+    }
+
+    for (size_t index : worker.pending) {
+        const StreamBuffer &b = (*mNextCapturedBuffers)[index];
+        switch (b.format) {
+            case HAL_PIXEL_FORMAT_RGBA_8888:
+                captureRGBA(source, worker.scaler, b.img, b.width, b.height);
+                break;
+            case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+                captureNV21(source, worker.scaler, b.img, b.width, b.height);
+                break;
+            case HAL_PIXEL_FORMAT_YCbCr_420_888:
+                captureNV12(source, worker.scaler, b.img, b.width, b.height, &b.ycbcr);
+                break;
+            default:
+                continue;
+        }
+        mOutputsConverted.fetch_add(1, std::memory_order_relaxed);
+        setHeldOutput(b);
+        // An unscaled NV12 output is a plain copy of the client frame anyway.
+        bool copied = !scaled && b.format == HAL_PIXEL_FORMAT_YCbCr_420_888 &&
+                      in.layout() == FrameHandle::Layout::kNV12;
+        if (mCacheFrames > 0 && !copied) {
+            cacheOutput(worker, b);
+        }
+    }
+}
+
+bool Sensor::outputRegion(const StreamBuffer &b, OutputRegion *region) {
+    size_t lumaSize = size_t(b.width) * b.height;
+    size_t chromaSize = size_t(b.width) * ((b.height + 1) / 2);
+    *region = OutputRegion();
+    region->base = b.img;
+    switch (b.format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+            region->size = lumaSize * 4;
+            break;
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+            region->size = lumaSize + chromaSize;
+            break;
+        case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            if (b.ycbcr.y != nullptr && b.ycbcr.chroma_step == 2) {
+                // Planes as captureNV12() writes them, from the first to the
+                // end of the last row of the last one.
+                uint8_t *y = static_cast<uint8_t *>(b.ycbcr.y);
+                uint8_t *cb = static_cast<uint8_t *>(b.ycbcr.cb);
+                uint8_t *cr = static_cast<uint8_t *>(b.ycbcr.cr);
+                uint8_t *uv = std::min(cb, cr);
+                if (b.height == 0) return false;
+                uint8_t *yEnd = y + b.ycbcr.ystride * (b.height - 1) + b.width;
+                uint8_t *uvEnd = uv + b.ycbcr.cstride * ((b.height + 1) / 2 - 1) + b.width;
+                region->base = std::min(y, uv);
+                region->size = std::max(yEnd, uvEnd) - region->base;
+                region->layout = {size_t(y - region->base), size_t(cb - region->base),
+                                  size_t(cr - region->base), b.ycbcr.ystride, b.ycbcr.cstride};
+            } else {
+                region->size = lumaSize + chromaSize;
+            }
+            break;
+        default:
+            return false;
+    }
+    return region->base != nullptr && region->size > 0;
+}
+
+void Sensor::setHeldOutput(const StreamBuffer &b) {
+    if (b.buffer == nullptr) return;
+
+    std::lock_guard<std::mutex> lock(mHeldOutputsMutex);
+    HeldOutput held = {*b.buffer, mConfiguration, mInputGeneration, b.format, b.width, b.height};
+    for (HeldOutput &entry : mHeldOutputs) {
+        if (entry.handle == held.handle && entry.configuration == held.configuration) {
+            entry = held;
+            return;
+        }
+    }
+    // Buffers holding older client frames are of no more use.
+    mHeldOutputs.erase(std::remove_if(mHeldOutputs.begin(), mHeldOutputs.end(),
+                                      [this](const HeldOutput &entry) {
+                                          return entry.configuration != mConfiguration ||
+                                                 entry.generation != mInputGeneration;
+                                      }),
+                       mHeldOutputs.end());
+    mHeldOutputs.push_back(held);
+}
+
+bool Sensor::reuseOutput(CaptureWorker &worker, const StreamBuffer &b) {
+    if (b.buffer != nullptr) {
+        std::lock_guard<std::mutex> lock(mHeldOutputsMutex);
+        for (const HeldOutput &held : mHeldOutputs) {
+            if (held.handle == *b.buffer && held.configuration == mConfiguration &&
+                held.generation == mInputGeneration &&
+                held.format == b.format && held.width == b.width && held.height == b.height) {
+                mOutputsHeld.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+
+    OutputRegion region;
+    if (!outputRegion(b, &region)) return false;
+    for (const CachedOutput &cached : worker.outputs) {
+        if (cached.generation == mInputGeneration && cached.format == b.format &&
+            cached.width == b.width && cached.height == b.height &&
+            cached.region.size == region.size && cached.region.layout == region.layout) {
+            memcpy(region.base, cached.data.get(), region.size);
+            mOutputsCopied.fetch_add(1, std::memory_order_relaxed);
+            setHeldOutput(b);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Sensor::cacheOutput(CaptureWorker &worker, const StreamBuffer &b) {
+    OutputRegion region;
+    if (!outputRegion(b, &region)) return;
+
+    CachedOutput *cached = nullptr;
+    for (CachedOutput &output : worker.outputs) {
+        if (output.format == b.format && output.width == b.width && output.height == b.height) {
+            cached = &output;
+            break;
+        }
+    }
+    if (cached == nullptr) {
+        worker.outputs.emplace_back();
+        cached = &worker.outputs.back();
+        cached->format = b.format;
+        cached->width = b.width;
+        cached->height = b.height;
+    }
+    if (cached->capacity < region.size) {
+        cached->data.reset(ScratchBufferPool::getInstance().acquire(region.size));
+        cached->capacity = cached->data ? region.size : 0;
+    }
+    if (!cached->data) {
+        cached->generation = 0;
+        return;
+    }
+    memcpy(cached->data.get(), region.base, region.size);
+    cached->generation = mInputGeneration;
+    cached->region = region;
+}
+
+void Sensor::captureRGBA(const FrameHandle &in, YuvScaler &scaler, uint8_t *img, uint32_t width,
+                         uint32_t height) {
+    ALOGVV("%s: E", __FUNCTION__);
+
+    int dst_stride_abgr = width * 4;
 
     // For Max supported Resolution.
-    if (width == (uint32_t)mSrcWidth && height == (uint32_t)mSrcHeight) {
-        if (gIsInFrameI420 || gIsInFrameMJPG) {
+    if (width == (uint32_t)in.width() && height == (uint32_t)in.height()) {
+        if (in.layout() == FrameHandle::Layout::kI420) {
             ALOGVV(LOG_TAG " %s: I420, scaling not required: Size = %dx%d", __FUNCTION__, width,
                    height);
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_u = bufData + src_size;
-            int src_stride_u = src_stride_y >> 1;
-            const uint8_t *src_v = bufData + src_size + src_size / 4;
-            int src_stride_v = src_stride_y >> 1;
-            uint8_t *dst_abgr = img;
-            int dst_stride_abgr = width * 4;
-
-            if (int ret =
-                    libyuv::I420ToABGR(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                       src_stride_v, dst_abgr, dst_stride_abgr, width, height)) {
-            }
+            forEachBand(height, [&](int y, int rows) {
+                libyuv::I420ToABGR(in.row(0, y), in.stride(0), in.row(1, y / 2), in.stride(1),
+                                   in.row(2, y / 2), in.stride(2),
+                                   img + size_t(dst_stride_abgr) * y, dst_stride_abgr, width,
+                                   rows);
+            });
         } else {
             ALOGVV(LOG_TAG " %s: NV12, scaling not required: Size = %dx%d", __FUNCTION__, width,
                    height);
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_uv = bufData + src_size;
-            int src_stride_uv = width;
-            uint8_t *dst_abgr = img;
-            int dst_stride_abgr = width * 4;
-
-            if (int ret = libyuv::NV12ToABGR(src_y, src_stride_y, src_uv, src_stride_uv, dst_abgr,
-                                             dst_stride_abgr, width, height)) {
-            }
+            forEachBand(height, [&](int y, int rows) {
+                libyuv::NV12ToABGR(in.row(0, y), in.stride(0), in.row(1, y / 2), in.stride(1),
+                                   img + size_t(dst_stride_abgr) * y, dst_stride_abgr, width,
+                                   rows);
+            });
         }
         // For upscaling and downscaling all other resolutions below max supported resolution.
     } else {
-        if (gIsInFrameI420 || gIsInFrameMJPG) {
-            ALOGVV(LOG_TAG " %s: I420, need to scale: Size = %dx%d", __FUNCTION__, width, height);
-            int destFrameSize = width * height;
-
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_u = bufData + src_size;
-            int src_stride_u = src_stride_y >> 1;
-            const uint8_t *src_v = bufData + src_size + src_size / 4;
-            int src_stride_v = src_stride_y >> 1;
-            int src_width = mSrcWidth;
-            int src_height = mSrcHeight;
-            uint8_t *dst_y = mDstPrevBuf.data();
-            int dst_stride_y = width;
-            uint8_t *dst_u = mDstPrevBuf.data() + destFrameSize;
-            int dst_stride_u = width >> 1;
-            uint8_t *dst_v = mDstPrevBuf.data() + destFrameSize + destFrameSize / 4;
-            int dst_stride_v = width >> 1;
-            int dst_width = width;
-            int dst_height = height;
-            auto filtering = libyuv::kFilterNone;
-
-            if (int ret = libyuv::I420Scale(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                            src_stride_v, src_width, src_height, dst_y,
-                                            dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                            dst_width, dst_height, filtering)) {
-            }
-            ALOGVV("%s: I420, Scaling done!", __FUNCTION__);
-
-            src_y = mDstPrevBuf.data();
-            src_stride_y = width;
-            src_u = mDstPrevBuf.data() + destFrameSize;
-            src_stride_u = width >> 1;
-            src_v = mDstPrevBuf.data() + destFrameSize + destFrameSize / 4;
-            src_stride_v = width >> 1;
-            uint8_t *dst_abgr = img;
-            int dst_stride_abgr = width * 4;
-
-            if (int ret =
-                    libyuv::I420ToABGR(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                       src_stride_v, dst_abgr, dst_stride_abgr, width, height)) {
-            }
-        } else {
-            ALOGVV(LOG_TAG " %s: NV12 scaling required: Size = %dx%d", __FUNCTION__, width, height);
-
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_uv = bufData + src_size;
-            int src_stride_uv = mSrcWidth;
-            uint8_t *dst_y = mDstTempPrevBuf.data();
-            int dst_stride_y = mSrcWidth;
-            uint8_t *dst_u = mDstTempPrevBuf.data() + src_size;
-            int dst_stride_u = mSrcWidth >> 1;
-            uint8_t *dst_v = mDstTempPrevBuf.data() + src_size + src_size / 4;
-            int dst_stride_v = mSrcWidth >> 1;
-
-            if (int ret = libyuv::NV12ToI420(src_y, src_stride_y, src_uv, src_stride_uv, dst_y,
-                                             dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                             mSrcWidth, mSrcHeight)) {
-            }
-
-            src_y = mDstTempPrevBuf.data();
-            src_stride_y = mSrcWidth;
-            const uint8_t *src_u = mDstTempPrevBuf.data() + src_size;
-            int src_stride_u = mSrcWidth >> 1;
-            const uint8_t *src_v = mDstTempPrevBuf.data() + src_size + src_size / 4;
-            int src_stride_v = mSrcWidth >> 1;
-            int src_width = mSrcWidth;
-            int src_height = mSrcHeight;
-
-            dst_y = mDstPrevBuf.data();
-            dst_stride_y = width;
-            dst_u = mDstPrevBuf.data() + dstFrameSize;
-            dst_stride_u = width >> 1;
-            dst_v = mDstPrevBuf.data() + dstFrameSize + dstFrameSize / 4;
-            dst_stride_v = width >> 1;
-            int dst_width = width;
-            int dst_height = height;
-            auto filtering = libyuv::kFilterNone;
-
-            if (int ret = libyuv::I420Scale(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                            src_stride_v, src_width, src_height, dst_y,
-                                            dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                            dst_width, dst_height, filtering)) {
-            }
-
-            src_y = mDstPrevBuf.data();
-            src_stride_y = width;
-            src_u = mDstPrevBuf.data() + dstFrameSize;
-            src_stride_u = width >> 1;
-            src_v = mDstPrevBuf.data() + dstFrameSize + dstFrameSize / 4;
-            src_stride_v = width >> 1;
-
-            uint8_t *dst_abgr = img;
-            int dst_stride_abgr = width * 4;
-
-            if (int ret =
-                    libyuv::I420ToABGR(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                       src_stride_v, dst_abgr, dst_stride_abgr, width, height)) {
-            }
-        }
+        ALOGVV(LOG_TAG " %s: %s, need to scale: Size = %dx%d", __FUNCTION__,
+               in.layout() == FrameHandle::Layout::kI420 ? "I420" : "NV12", width, height);
+        scaler.prepare(in, width, height);
+        forEachBand(height, [&](int y, int rows) {
+            scaler.toABGRRows(in, img, dst_stride_abgr, y, rows);
+        });
     }
 
     ALOGVV(" %s: Captured RGB32 image sucessfully..", __FUNCTION__);
@@ -843,204 +1077,76 @@ void Sensor::saveNV21(uint8_t *img, uint32_t size) {
     fclose(f);
 }
 
-void Sensor::captureNV12(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height) {
+void Sensor::captureNV12(const FrameHandle &in, YuvScaler &scaler, uint8_t *img, uint32_t width,
+                         uint32_t height, const android_ycbcr *ycbcr) {
     ALOGVV(LOG_TAG "%s: E", __FUNCTION__);
 
-    ClientVideoBuffer *handle = ClientVideoBuffer::getClientInstance();
-    //uint8_t *bufData = handle->clientBuf[handle->clientRevCount % 1].buffer;
-    #ifdef CROP_ROTATE
-    uint8_t *bufData = (uint8_t *)buffer_recv;
-    #else
-    uint8_t *bufData = handle->clientBuf[handle->clientRevCount % 1].buffer;
-    #endif
-
-    int cameraInputDataSize;
-
-    ALOGVV(LOG_TAG " %s: bufData[%p] img[%p] resolution[%d:%d]", __func__, bufData, img, width,
+    ALOGVV(LOG_TAG " %s: input[%p] img[%p] resolution[%d:%d]", __func__, in.data(0), img, width,
            height);
+    int dstFrameSize = width * height;
 
-    if (!gIsInFrameI420 && !gIsInFrameH264 && !gIsInFrameMJPG) {
-        ALOGE("%s Exit - only H264, I420 input frames supported", __FUNCTION__);
-        return;
-    }
-
-    // Initialize the input data size based on client camera resolution.
-    cameraInputDataSize = mSrcFrameSize;
-#ifdef ENABLE_FFMPEG
-    if (gIsInFrameH264) {
-        if (handle->clientBuf[handle->clientRevCount % 1].decoded) {
-            // Already decoded camera input as part of preview frame.
-            // This is the default condition in most of the apps.
-            ALOGVV("%s - Already Decoded Camera Input frame..", __FUNCTION__);
-        } else {
-            // To get the decoded frame for the apps which doesn't have RGBA preview.
-            getNV12Frames(bufData, &cameraInputDataSize);
-            handle->clientBuf[handle->clientRevCount % 1].decoded = true;
-            std::unique_lock<std::mutex> ulock(client_buf_mutex);
-            handle->decodedFrameNo++;
-            ALOGVV("%s Decoded Camera Input Frame No: %zd with size of %d", __FUNCTION__,
-                   handle->decodedFrameNo, cameraInputDataSize);
-            ulock.unlock();
-        }
+    // Write with the plane layout and chroma order the buffer was locked
+    // with, which need not be tightly packed; chroma is interleaved either
+    // way. Without one, NV21 but on SG1, as always.
+    uint8_t *out_y = img;
+    int out_stride_y = width;
+    uint8_t *out_uv = img + dstFrameSize;
+    int out_stride_uv = width;
+    bool vuOrder = m_major_version != 1;
+    if (ycbcr != nullptr && ycbcr->y != nullptr && ycbcr->chroma_step == 2) {
+        uint8_t *cb = static_cast<uint8_t *>(ycbcr->cb);
+        uint8_t *cr = static_cast<uint8_t *>(ycbcr->cr);
+        out_y = static_cast<uint8_t *>(ycbcr->y);
+        out_stride_y = ycbcr->ystride;
+        out_uv = std::min(cb, cr);
+        out_stride_uv = ycbcr->cstride;
+        vuOrder = cr < cb;
     }
-#endif
-    int src_size = mSrcWidth * mSrcHeight;
-    int dstFrameSize = width * height;
 
     // For Max supported Resolution.
-    if (width == (uint32_t)mSrcWidth && height == (uint32_t)mSrcHeight) {
-        if (gIsInFrameI420 || gIsInFrameMJPG) {
+    if (width == (uint32_t)in.width() && height == (uint32_t)in.height()) {
+        if (in.layout() == FrameHandle::Layout::kI420) {
             // For I420 input support
             ALOGVV(LOG_TAG " %s: I420 no scaling required Size = %dx%d", __FUNCTION__, width,
                    height);
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_u = bufData + src_size;
-            int src_stride_u = mSrcWidth >> 1;
-            const uint8_t *src_v = bufData + src_size + src_size / 4;
-            int src_stride_v = mSrcWidth >> 1;
-            uint8_t *dst_y = img;
-            int dst_stride_y = width;
-            uint8_t *dst_uv = dst_y + src_size;
-            int dst_stride_uv = width;
-            if (m_major_version == 1) {
-                ALOGVV(LOG_TAG " %s: [SG1] convert I420 to NV12!", __FUNCTION__);
-                if (int ret = libyuv::I420ToNV12(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                                 src_stride_v, dst_y, dst_stride_y, dst_uv,
-                                                 dst_stride_uv, width, height)) {
+            ALOGVV(LOG_TAG " %s: convert I420 to %s!", __FUNCTION__, vuOrder ? "NV21" : "NV12");
+            forEachBand(height, [&](int y, int rows) {
+                uint8_t *dst_y = out_y + size_t(out_stride_y) * y;
+                uint8_t *dst_uv = out_uv + size_t(out_stride_uv) * (y / 2);
+                if (vuOrder) {
+                    libyuv::I420ToNV21(in.row(0, y), in.stride(0), in.row(1, y / 2), in.stride(1),
+                                       in.row(2, y / 2), in.stride(2), dst_y, out_stride_y,
+                                       dst_uv, out_stride_uv, width, rows);
+                } else {
+                    libyuv::I420ToNV12(in.row(0, y), in.stride(0), in.row(1, y / 2), in.stride(1),
+                                       in.row(2, y / 2), in.stride(2), dst_y, out_stride_y,
+                                       dst_uv, out_stride_uv, width, rows);
                 }
-            } else {
-                ALOGVV(LOG_TAG " %s: [NON-SG1] convert I420 to NV21!", __FUNCTION__);
-                if (int ret = libyuv::I420ToNV21(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                                 src_stride_v, dst_y, dst_stride_y, dst_uv,
-                                                 dst_stride_uv, width, height)) {
-                }
-            }
+            });
         } else {
-            // For NV12 Input support. No Color conversion
+            // For NV12 Input support. No Color conversion, just a copy per plane.
             ALOGVV(LOG_TAG " %s: NV12 frame without scaling and color conversion: Size = %dx%d",
                    __FUNCTION__, width, height);
-            memcpy(img, bufData, cameraInputDataSize);
-        }
-        // For upscaling and downscaling all other resolutions below max supported resolution.
-    } else {
-        if (gIsInFrameI420 || gIsInFrameMJPG) {
-            // For I420 input support
-            ALOGVV(LOG_TAG " %s: I420 with scaling: Size = %dx%d", __FUNCTION__, width, height);
-
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_u = bufData + src_size;
-            int src_stride_u = src_stride_y >> 1;
-            const uint8_t *src_v = bufData + src_size + src_size / 4;
-            int src_stride_v = src_stride_y >> 1;
-            int src_width = mSrcWidth;
-            int src_height = mSrcHeight;
-            uint8_t *dst_y = mDstBuf.data();
-            int dst_stride_y = width;
-            uint8_t *dst_u = mDstBuf.data() + dstFrameSize;
-            int dst_stride_u = width >> 1;
-            uint8_t *dst_v = mDstBuf.data() + dstFrameSize + dstFrameSize / 4;
-            int dst_stride_v = width >> 1;
-            int dst_width = width;
-            int dst_height = height;
-            auto filtering = libyuv::kFilterNone;
-
-            if (int ret = libyuv::I420Scale(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                            src_stride_v, src_width, src_height, dst_y,
-                                            dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                            dst_width, dst_height, filtering)) {
-            }
-
-            ALOGVV("%s: I420, Scaling done!", __FUNCTION__);
-
-            src_y = mDstBuf.data();
-            src_stride_y = width;
-            src_u = mDstBuf.data() + dstFrameSize;
-            src_stride_u = width >> 1;
-            src_v = mDstBuf.data() + dstFrameSize + dstFrameSize / 4;
-            src_stride_v = width >> 1;
-            dst_y = img;
-            dst_stride_y = width;
-
-            uint8_t *dst_uv = dst_y + width * height;
-            int dst_stride_uv = width;
-
-            if (m_major_version == 1) {
-                ALOGVV(LOG_TAG " %s: [SG1] convert I420 to NV12!", __FUNCTION__);
-                if (int ret = libyuv::I420ToNV12(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                                 src_stride_v, dst_y, dst_stride_y, dst_uv,
-                                                 dst_stride_uv, width, height)) {
-                }
+            if (vuOrder) {
+                scaler.prepare(in, width, height);
+                forEachBand(height, [&](int y, int rows) {
+                    scaler.toSemiPlanarRows(in, out_y, out_stride_y, out_uv, out_stride_uv, y,
+                                            rows, true);
+                });
             } else {
-                ALOGVV(LOG_TAG " %s: [NON-SG1] convert I420 to NV21!", __FUNCTION__);
-                if (int ret = libyuv::I420ToNV21(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                                 src_stride_v, dst_y, dst_stride_y, dst_uv,
-                                                 dst_stride_uv, width, height)) {
-                }
-            }
-        } else {
-            // For NV12 Input support
-            ALOGVV(LOG_TAG " %s: NV12 frame with scaling to Size = %dx%d", __FUNCTION__, width,
-                   height);
-
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_uv = bufData + src_size;
-            int src_stride_uv = mSrcWidth;
-            uint8_t *dst_y = mDstTempBuf.data();
-            int dst_stride_y = mSrcWidth;
-            uint8_t *dst_u = mDstTempBuf.data() + src_size;
-            int dst_stride_u = mSrcWidth >> 1;
-            uint8_t *dst_v = mDstTempBuf.data() + src_size + src_size / 4;
-            int dst_stride_v = mSrcWidth >> 1;
-
-            if (int ret = libyuv::NV12ToI420(src_y, src_stride_y, src_uv, src_stride_uv, dst_y,
-                                             dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                             mSrcWidth, mSrcHeight)) {
-            }
-
-            src_y = mDstTempBuf.data();
-            src_stride_y = mSrcWidth;
-
-            uint8_t *src_u = mDstTempBuf.data() + src_size;
-            int src_stride_u = src_stride_y >> 1;
-            const uint8_t *src_v = mDstTempBuf.data() + src_size + src_size / 4;
-            int src_stride_v = src_stride_y >> 1;
-            int src_width = mSrcWidth;
-            int src_height = mSrcHeight;
-
-            dst_y = mDstBuf.data();
-            dst_stride_y = width;
-            dst_u = mDstBuf.data() + dstFrameSize;
-            dst_stride_u = width >> 1;
-            dst_v = mDstBuf.data() + dstFrameSize + dstFrameSize / 4;
-            dst_stride_v = width >> 1;
-            int dst_width = width;
-            int dst_height = height;
-            auto filtering = libyuv::kFilterNone;
-
-            if (int ret = libyuv::I420Scale(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                            src_stride_v, src_width, src_height, dst_y,
-                                            dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                            dst_width, dst_height, filtering)) {
-            }
-            src_y = mDstBuf.data();
-            src_stride_y = width;
-            src_u = mDstBuf.data() + dstFrameSize;
-            src_stride_u = width >> 1;
-            src_v = mDstBuf.data() + dstFrameSize + dstFrameSize / 4;
-            src_stride_v = width >> 1;
-            dst_y = img;
-            dst_stride_y = width;
-
-            uint8_t *dst_uv = dst_y + dstFrameSize;
-            int dst_stride_uv = width;
-            if (int ret = libyuv::I420ToNV12(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                             src_stride_v, dst_y, dst_stride_y, dst_uv,
-                                             dst_stride_uv, width, height)) {
+                // Bound by memory bandwidth, not worth banding.
+                in.copyToNV12(out_y, out_stride_y, out_uv, out_stride_uv);
             }
         }
+        // For upscaling and downscaling all other resolutions below max supported resolution.
+    } else {
+        ALOGVV(LOG_TAG " %s: %s with scaling: Size = %dx%d", __FUNCTION__,
+               in.layout() == FrameHandle::Layout::kI420 ? "I420" : "NV12", width, height);
+        scaler.prepare(in, width, height);
+        forEachBand(height, [&](int y, int rows) {
+            scaler.toSemiPlanarRows(in, out_y, out_stride_y, out_uv, out_stride_uv, y, rows,
+                                    vuOrder);
+        });
     }
 
 #if 0
@@ -1051,222 +1157,33 @@ void Sensor::captureNV12(uint8_t *img, uint32_t gain, uint32_t width, uint32_t h
     ALOGVV(LOG_TAG " %s: Captured NV12 image sucessfully..", __FUNCTION__);
 }
 
-void Sensor::captureNV21(uint8_t *img, uint32_t gain, uint32_t width, uint32_t height) {
+void Sensor::captureNV21(const FrameHandle &in, YuvScaler &scaler, uint8_t *img, uint32_t width,
+                         uint32_t height) {
     ALOGVV("%s: E", __FUNCTION__);
 
-    ClientVideoBuffer *handle = ClientVideoBuffer::getClientInstance();
-    //uint8_t *bufData = handle->clientBuf[handle->clientRevCount % 1].buffer;
-  //  #ifdef CROP_ROTATE
-  //  uint8_t *bufData = (uint8_t *)buffer_recv;
-  //  #else
-    uint8_t *bufData = handle->clientBuf[handle->clientRevCount % 1].buffer;
-    //#endif
-
-    int src_size = mSrcWidth * mSrcHeight;
-    int dstFrameSize = width * height;
-
-    int cameraInputDataSize;
-
-    if (!gIsInFrameI420 && !gIsInFrameH264 && !gIsInFrameMJPG) {
-        ALOGE("%s Exit - only H264, H265, I420 input frames supported", __FUNCTION__);
-        return;
-    }
-
-    // Initialize the input data size based on client camera resolution.
-    cameraInputDataSize = mSrcFrameSize;
-
-#ifdef ENABLE_FFMPEG
-    if (gIsInFrameH264) {
-        if (handle->clientBuf[handle->clientRevCount % 1].decoded) {
-            // If already decoded camera input frame.
-            ALOGVV("%s - Already Decoded Camera Input frame", __FUNCTION__);
-        } else {
-            // To get the decoded frame.
-            getNV12Frames(bufData, &cameraInputDataSize);
-            handle->clientBuf[handle->clientRevCount % 1].decoded = true;
-            std::unique_lock<std::mutex> ulock(client_buf_mutex);
-            handle->decodedFrameNo++;
-            ALOGVV("%s Decoded Camera Input Frame No: %zd with size of %d", __FUNCTION__,
-                   handle->decodedFrameNo, cameraInputDataSize);
-            ulock.unlock();
-        }
-    }
-#endif
+    uint8_t *dst_vu = img + size_t(width) * height;
+    int dst_stride = width;
 
     //For default resolution 640x480p
-    if (width == (uint32_t)mSrcWidth && height == (uint32_t)mSrcHeight) {
-        // For I420 input
-        if (gIsInFrameI420 || gIsInFrameMJPG) {
-            ALOGVV(LOG_TAG "%s: I420 to NV21 conversion without scaling: Size = %dx%d",
-                   __FUNCTION__, width, height);
-
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_u = bufData + src_size;
-            int src_stride_u = mSrcWidth >> 1;
-            const uint8_t *src_v = bufData + src_size + src_size / 4;
-            int src_stride_v = mSrcWidth >> 1;
-
-            uint8_t *dst_y = img;
-            int dst_stride_y = width;
-            uint8_t *dst_vu = dst_y + src_size;
-            int dst_stride_vu = width;
-
-            if (int ret = libyuv::I420ToNV21(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                             src_stride_v, dst_y, dst_stride_y, dst_vu,
-                                             dst_stride_vu, width, height)) {
-            }
-            // For NV12 input
-        } else {
-            ALOGVV(LOG_TAG "%s: NV12 to NV21 conversion without scaling: Size = %dx%d",
-                   __FUNCTION__, width, height);
-
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_uv = bufData + src_size;
-            int src_stride_uv = mSrcWidth;
-
-            uint8_t *dst_y = mDstJpegBuf.data();
-            int dst_stride_y = mSrcWidth;
-            uint8_t *dst_u = mDstJpegBuf.data() + src_size;
-            int dst_stride_u = mSrcWidth >> 1;
-            uint8_t *dst_v = mDstJpegBuf.data() + src_size + src_size / 4;
-            int dst_stride_v = mSrcWidth >> 1;
-
-            if (int ret = libyuv::NV12ToI420(src_y, src_stride_y, src_uv, src_stride_uv, dst_y,
-                                             dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                             mSrcWidth, mSrcHeight)) {
-            }
-
-            src_y = mDstJpegBuf.data();
-            src_stride_y = mSrcWidth;
-            uint8_t *src_u = mDstJpegBuf.data() + src_size;
-            int src_stride_u = src_stride_y >> 1;
-            const uint8_t *src_v = mDstJpegBuf.data() + src_size + src_size / 4;
-            int src_stride_v = src_stride_y >> 1;
-
-            dst_y = img;
-            dst_stride_y = width;
-            uint8_t *dst_vu = dst_y + dstFrameSize;
-            int dst_stride_vu = width;
-
-            if (int ret = libyuv::I420ToNV21(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                             src_stride_v, dst_y, dst_stride_y, dst_vu,
-                                             dst_stride_vu, width, height)) {
-            }
-        }
-        // For upscaling and downscaling all other resolutions below max supported resolution.
+    if (width == (uint32_t)in.width() && height == (uint32_t)in.height() &&
+        in.layout() == FrameHandle::Layout::kI420) {
+        ALOGVV(LOG_TAG "%s: I420 to NV21 conversion without scaling: Size = %dx%d", __FUNCTION__,
+               width, height);
+        forEachBand(height, [&](int y, int rows) {
+            libyuv::I420ToNV21(in.row(0, y), in.stride(0), in.row(1, y / 2), in.stride(1),
+                               in.row(2, y / 2), in.stride(2), img + size_t(dst_stride) * y,
+                               dst_stride, dst_vu + size_t(dst_stride) * (y / 2), dst_stride,
+                               width, rows);
+        });
+        // For NV12 input Y as is, chroma pairs swapped, and for upscaling and
+        // downscaling all other resolutions.
     } else {
-        // For I420 input
-        if (gIsInFrameI420 || gIsInFrameMJPG) {
-            ALOGVV(LOG_TAG "%s: I420 to NV21 with scaling: Size = %dx%d", __FUNCTION__, width,
-                   height);
-
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_u = bufData + src_size;
-            int src_stride_u = src_stride_y >> 1;
-            const uint8_t *src_v = bufData + src_size + src_size / 4;
-            int src_stride_v = src_stride_y >> 1;
-            int src_width = mSrcWidth;
-            int src_height = mSrcHeight;
-
-            uint8_t *dst_y = mDstJpegBuf.data();
-            int dst_stride_y = width;
-            uint8_t *dst_u = mDstJpegBuf.data() + dstFrameSize;
-            int dst_stride_u = width >> 1;
-            uint8_t *dst_v = mDstJpegBuf.data() + dstFrameSize + dstFrameSize / 4;
-            int dst_stride_v = width >> 1;
-            int dst_width = width;
-            int dst_height = height;
-            auto filtering = libyuv::kFilterNone;
-
-            if (int ret = libyuv::I420Scale(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                            src_stride_v, src_width, src_height, dst_y,
-                                            dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                            dst_width, dst_height, filtering)) {
-            }
-
-            src_y = mDstJpegBuf.data();
-            src_stride_y = width;
-            src_u = mDstJpegBuf.data() + dstFrameSize;
-            src_stride_u = width >> 1;
-            src_v = mDstJpegBuf.data() + dstFrameSize + dstFrameSize / 4;
-            src_stride_v = width >> 1;
-            dst_y = img;
-            dst_stride_y = width;
-
-            uint8_t *dst_vu = dst_y + width * height;
-            int dst_stride_vu = width;
-
-            if (int ret = libyuv::I420ToNV21(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                             src_stride_v, dst_y, dst_stride_y, dst_vu,
-                                             dst_stride_vu, width, height)) {
-            }
-            // For NV12 input
-        } else {
-            ALOGVV(LOG_TAG "%s: NV12 to NV21 conversion with scaling: Size = %dx%d", __FUNCTION__,
-                   width, height);
-
-            const uint8_t *src_y = bufData;
-            int src_stride_y = mSrcWidth;
-            const uint8_t *src_uv = bufData + src_size;
-            int src_stride_uv = mSrcWidth;
-
-            uint8_t *dst_y = mDstJpegTempBuf.data();
-            int dst_stride_y = mSrcWidth;
-            uint8_t *dst_u = mDstJpegTempBuf.data() + src_size;
-            int dst_stride_u = mSrcWidth >> 1;
-            uint8_t *dst_v = mDstJpegTempBuf.data() + src_size + src_size / 4;
-            int dst_stride_v = mSrcWidth >> 1;
-
-            if (int ret = libyuv::NV12ToI420(src_y, src_stride_y, src_uv, src_stride_uv, dst_y,
-                                             dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                             mSrcWidth, mSrcHeight)) {
-            }
-
-            src_y = mDstJpegTempBuf.data();
-            src_stride_y = mSrcWidth;
-            uint8_t *src_u = mDstJpegTempBuf.data() + src_size;
-            int src_stride_u = src_stride_y >> 1;
-            const uint8_t *src_v = mDstJpegTempBuf.data() + src_size + src_size / 4;
-            int src_stride_v = src_stride_y >> 1;
-            int src_width = mSrcWidth;
-            int src_height = mSrcHeight;
-
-            dst_y = mDstJpegBuf.data();
-            dst_stride_y = width;
-            dst_u = mDstJpegBuf.data() + dstFrameSize;
-            dst_stride_u = width >> 1;
-            dst_v = mDstJpegBuf.data() + dstFrameSize + dstFrameSize / 4;
-            dst_stride_v = width >> 1;
-            int dst_width = width;
-            int dst_height = height;
-            auto filtering = libyuv::kFilterNone;
-
-            if (int ret = libyuv::I420Scale(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                            src_stride_v, src_width, src_height, dst_y,
-                                            dst_stride_y, dst_u, dst_stride_u, dst_v, dst_stride_v,
-                                            dst_width, dst_height, filtering)) {
-            }
-
-            src_y = mDstJpegBuf.data();
-            src_stride_y = width;
-            src_u = mDstJpegBuf.data() + dstFrameSize;
-            src_stride_u = width >> 1;
-            src_v = mDstJpegBuf.data() + dstFrameSize + dstFrameSize / 4;
-            src_stride_v = width >> 1;
-
-            dst_y = img;
-            dst_stride_y = width;
-            uint8_t *dst_vu = dst_y + dstFrameSize;
-            int dst_stride_vu = width;
-
-            if (int ret = libyuv::I420ToNV21(src_y, src_stride_y, src_u, src_stride_u, src_v,
-                                             src_stride_v, dst_y, dst_stride_y, dst_vu,
-                                             dst_stride_vu, width, height)) {
-            }
-        }
+        ALOGVV(LOG_TAG "%s: %s to NV21: Size = %dx%d", __FUNCTION__,
+               in.layout() == FrameHandle::Layout::kI420 ? "I420" : "NV12", width, height);
+        scaler.prepare(in, width, height);
+        forEachBand(height, [&](int y, int rows) {
+            scaler.toSemiPlanarRows(in, img, dst_stride, dst_vu, dst_stride, y, rows, true);
+        });
     }
     ALOGVV("%s: Captured NV21 image sucessfully..", __FUNCTION__);
 }